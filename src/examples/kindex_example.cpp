@@ -1,6 +1,8 @@
 #include <iostream>
 
 #include <kindex.h>
+#include <kindex_cache.h>
+#include <kindex_snapshot.h>
 
 using namespace kindex;
 
@@ -38,11 +40,12 @@ int main(int argc, char* argv[])
     d.conjunctions.push_back(c);
     std::vector<document> docs;
     docs.push_back(d);
-    indexer idx = indexer::create(docs);
+    SnapshotHolder<indexer> holder{ std::make_unique<indexer>(indexer::create(docs)) };
+    ResultCache<std::string, Assignment> cache{ 1024 };
 
     ResultSet result;
     Assignment s;
-    idx.retrieve(result, s);
+    cache.retrieve(holder.read(), result, s);
 
     for (auto& i : result.result_) {
         std::cout << "retrieve doc: " << i << std::endl;
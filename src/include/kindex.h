@@ -1,54 +1,413 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <concepts>
+#include <cstring>
+#include <exception>
+#include <istream>
+#include <iterator>
+#include <latch>
 #include <limits>
+#include <numeric>
+#include <ostream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <variant>
 #include <vector>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#    define KINDEX_X86_SIMD 1
+#    include <immintrin.h>
+#else
+#    define KINDEX_X86_SIMD 0
+#endif
+
+// Define to 1 to count the work of retrieve in RetrieveStats; otherwise the counters compile to nothing.
+#ifndef KINDEX_ENABLE_STATS
+#    define KINDEX_ENABLE_STATS 0
+#endif
+
+#if KINDEX_ENABLE_STATS
+#    define KINDEX_COUNT(counter, n) (::kindex::threadRetrieveStats().counter += (n))
+#else
+#    define KINDEX_COUNT(counter, n) ((void)0)
+#endif
+
 namespace kindex {
 
-namespace detail {
+// Work done by retrieve. All counts stay 0 unless KINDEX_ENABLE_STATS is 1.
+struct RetrieveStats
+{
+    // Size partitions of a shard matched.
+    uint64_t partitions = 0;
+
+    // Posting list groups built from the triggered lists, z lists included.
+    uint64_t groups = 0;
+
+    uint64_t skipTos = 0;
+
+    // Entries passed over by skipTo.
+    uint64_t skipped = 0;
+
+    uint64_t sorts = 0;
+
+    // Matching conjunctions.
+    uint64_t matches = 0;
+
+    // Conjunctions held by enough groups but excluded by a negative entry.
+    uint64_t rejections = 0;
+
+    RetrieveStats& operator+=(const RetrieveStats& other)
+    {
+        partitions += other.partitions;
+        groups += other.groups;
+        skipTos += other.skipTos;
+        skipped += other.skipped;
+        sorts += other.sorts;
+        matches += other.matches;
+        rejections += other.rejections;
+        return *this;
+    }
+
+    RetrieveStats& operator-=(const RetrieveStats& other)
+    {
+        partitions -= other.partitions;
+        groups -= other.groups;
+        skipTos -= other.skipTos;
+        skipped -= other.skipped;
+        sorts -= other.sorts;
+        matches -= other.matches;
+        rejections -= other.rejections;
+        return *this;
+    }
+};
+
+// The counts of every retrieve run on the calling thread, including the tasks it ran for other threads.
+inline RetrieveStats& threadRetrieveStats()
+{
+    static thread_local RetrieveStats stats;
+    return stats;
+}
 
-using EntryId = std::uint64_t;
+namespace detail {
 
-class Entry
+// Adds the counts of the calling thread during its lifetime to stats.
+class StatsScope
 {
 public:
-    Entry(EntryId docId, EntryId index, bool positive)
-      : value_((docId << 17) | (index << 1) | (positive ? EntryId{ 1 } : EntryId{ 0 }))
+#if KINDEX_ENABLE_STATS
+    explicit StatsScope(RetrieveStats& stats)
+      : stats_(stats)
+      , before_(threadRetrieveStats())
+    {
+    }
+
+    ~StatsScope()
     {
+        RetrieveStats delta = threadRetrieveStats();
+        delta -= before_;
+        stats_ += delta;
     }
 
-    inline EntryId id() const { return value_ >> 1; }
+private:
+    RetrieveStats& stats_;
+
+    RetrieveStats before_;
+#else
+    explicit StatsScope(RetrieveStats&) {}
+#endif
+};
+
+// A posting list entry packed into an unsigned Word as conjunctionId << 1 | positive. Conjunction ids are dense and
+// assigned to the distinct conjunctions in order of first occurrence; the Indexer maps them back to documents.
+template <typename Word>
+class BasicEntry
+{
+public:
+    using id_type = Word;
+
+    constexpr static unsigned bits = sizeof(Word) * 8;
 
-    inline EntryId documentId() const { return value_ >> 17; }
+    BasicEntry() = default;
 
-    inline EntryId conjunctionIndex() const { return (value_ >> 1) & 0xFFFF; }
+    BasicEntry(Word conjunctionId, bool positive)
+      : value_((conjunctionId << 1) | (positive ? Word{ 1 } : Word{ 0 }))
+    {
+    }
+
+    inline Word id() const { return value_ >> 1; }
 
     inline bool isNegative() const { return !(value_ & 1); }
 
-    inline bool operator==(Entry other) const { return value_ == other.value_; }
+    inline Word value() const { return value_; }
+
+    inline bool operator==(BasicEntry other) const { return value_ == other.value_; }
 
-    inline bool operator<(Entry other) const { return value_ < other.value_; }
+    inline bool operator<(BasicEntry other) const { return value_ < other.value_; }
 
-    inline constexpr static Entry max() { return Entry{ std::numeric_limits<EntryId>::max() }; }
+    inline constexpr static BasicEntry max() { return BasicEntry{ static_cast<Word>(~Word{ 0 }) }; }
 
 private:
-    constexpr Entry(EntryId id)
-      : value_(id)
+    constexpr BasicEntry(Word value)
+      : value_(value)
     {
     }
 
-    EntryId value_;
+    Word value_;
+};
+
+// Runs f(0) ... f(n - 1) on up to `threads` threads. Indices are handed out one by one, so callers order the work
+// from the most to the least expensive item to keep the threads balanced.
+template <typename Func>
+void parallelFor(size_t threads, size_t n, Func&& f)
+{
+    threads = std::min(threads, n);
+    if (threads <= 1) {
+        for (size_t i = 0; i < n; ++i) {
+            f(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next{ 0 };
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            f(i);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+// LSD radix sort over the bytes of Entry::value() that differ between entries, using tmp as scratch space.
+template <typename Entry>
+void radixSort(Entry* beg, Entry* end, Entry* tmp)
+{
+    using EntryId = typename Entry::id_type;
+
+    size_t size = end - beg;
+    if (size < 2) {
+        return;
+    }
+
+    size_t counts[sizeof(EntryId)][256] = {};
+    EntryId diff = 0;
+    for (auto* e = beg; e != end; ++e) {
+        EntryId v = e->value();
+        diff |= v ^ beg->value();
+        for (size_t d = 0; d < sizeof(EntryId); ++d) {
+            ++counts[d][(v >> (d * 8)) & 0xFF];
+        }
+    }
+
+    Entry* src = beg;
+    Entry* dst = tmp;
+    for (size_t d = 0; d < sizeof(EntryId); ++d) {
+        if (((diff >> (d * 8)) & 0xFF) == 0) {
+            continue;
+        }
+
+        size_t offsets[256];
+        size_t offset = 0;
+        for (size_t b = 0; b < 256; ++b) {
+            offsets[b] = offset;
+            offset += counts[d][b];
+        }
+        for (size_t i = 0; i < size; ++i) {
+            dst[offsets[(src[i].value() >> (d * 8)) & 0xFF]++] = src[i];
+        }
+        std::swap(src, dst);
+    }
+
+    if (src != beg) {
+        std::copy(src, src + size, beg);
+    }
+}
+
+// Sorts a posting list, leaving already sorted input untouched. Short lists use std::sort.
+template <typename Entry>
+void sortEntries(Entry* beg, Entry* end)
+{
+    if (std::is_sorted(beg, end)) {
+        return;
+    }
+
+    if (end - beg < 256) {
+        std::sort(beg, end);
+        return;
+    }
+
+    std::vector<Entry> tmp(end - beg);
+    radixSort(beg, end, tmp.data());
+}
+
+class Bitmap
+{
+public:
+    inline void resize(size_t size) { words_.resize((size + 63) / 64, 0); }
+
+    inline size_t size() const { return words_.size() * 64; }
+
+    inline bool test(size_t pos) const { return (pos < size()) && (words_[pos / 64] & (uint64_t{ 1 } << (pos % 64))); }
+
+    inline void set(size_t pos) { words_[pos / 64] |= (uint64_t{ 1 } << (pos % 64)); }
+
+    inline void clear() { words_.clear(); }
+
+    inline const std::vector<uint64_t>& words() const { return words_; }
+
+    inline std::vector<uint64_t>& words() { return words_; }
+
+private:
+    std::vector<uint64_t> words_;
 };
 
+template <typename Entry>
+using ScanFunc = const Entry* (*)(const Entry*, const Entry*, typename Entry::id_type);
+
+// Returns the first entry in [beg, end) whose value() is not less than value. The lists are sorted, so the entries
+// below value form a prefix; the vector kernels compare a block at a time and stop at the first block leaving it.
+template <typename Entry>
+const Entry* scanScalar(const Entry* beg, const Entry* end, typename Entry::id_type value)
+{
+    while ((beg != end) && (beg->value() < value)) {
+        ++beg;
+    }
+    return beg;
+}
+
+#if KINDEX_X86_SIMD
+// Unsigned compares are done as signed compares of values with the sign bit flipped.
+template <typename Entry>
+__attribute__((target("sse4.2"))) const Entry* scanSse(const Entry* beg, const Entry* end,
+                                                        typename Entry::id_type value)
+{
+    if constexpr (sizeof(Entry) == 8) {
+        const __m128i bias = _mm_set1_epi64x(std::numeric_limits<int64_t>::min());
+        const __m128i target = _mm_xor_si128(_mm_set1_epi64x(value), bias);
+        for (; end - beg >= 2; beg += 2) {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(beg)), bias);
+            unsigned less = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(target, v)));
+            if (less != 0x3) {
+                return beg + std::countr_one(less);
+            }
+        }
+    } else {
+        const __m128i bias = _mm_set1_epi32(std::numeric_limits<int32_t>::min());
+        const __m128i target = _mm_xor_si128(_mm_set1_epi32(value), bias);
+        for (; end - beg >= 4; beg += 4) {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(beg)), bias);
+            unsigned less = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, v)));
+            if (less != 0xF) {
+                return beg + std::countr_one(less);
+            }
+        }
+    }
+    return scanScalar(beg, end, value);
+}
+
+template <typename Entry>
+__attribute__((target("avx2"))) const Entry* scanAvx2(const Entry* beg, const Entry* end,
+                                                       typename Entry::id_type value)
+{
+    if constexpr (sizeof(Entry) == 8) {
+        const __m256i bias = _mm256_set1_epi64x(std::numeric_limits<int64_t>::min());
+        const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x(value), bias);
+        for (; end - beg >= 4; beg += 4) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(beg)), bias);
+            unsigned less = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, v)));
+            if (less != 0xF) {
+                return beg + std::countr_one(less);
+            }
+        }
+    } else {
+        const __m256i bias = _mm256_set1_epi32(std::numeric_limits<int32_t>::min());
+        const __m256i target = _mm256_xor_si256(_mm256_set1_epi32(value), bias);
+        for (; end - beg >= 8; beg += 8) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(beg)), bias);
+            unsigned less = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, v)));
+            if (less != 0xFF) {
+                return beg + std::countr_one(less);
+            }
+        }
+    }
+    return scanScalar(beg, end, value);
+}
+
+template <typename Entry>
+__attribute__((target("avx512f"))) const Entry* scanAvx512(const Entry* beg, const Entry* end,
+                                                            typename Entry::id_type value)
+{
+    if constexpr (sizeof(Entry) == 8) {
+        const __m512i target = _mm512_set1_epi64(value);
+        for (; end - beg >= 8; beg += 8) {
+            unsigned less = _mm512_cmplt_epu64_mask(_mm512_loadu_si512(beg), target);
+            if (less != 0xFF) {
+                return beg + std::countr_one(less);
+            }
+        }
+    } else {
+        const __m512i target = _mm512_set1_epi32(value);
+        for (; end - beg >= 16; beg += 16) {
+            unsigned less = _mm512_cmplt_epu32_mask(_mm512_loadu_si512(beg), target);
+            if (less != 0xFFFF) {
+                return beg + std::countr_one(less);
+            }
+        }
+    }
+    return scanScalar(beg, end, value);
+}
+#endif
+
+// Picks the widest kernel the cpu supports for the entry width, falling back to the scalar loop.
+template <typename Entry>
+ScanFunc<Entry> selectScan()
+{
+#if KINDEX_X86_SIMD
+    if constexpr ((sizeof(Entry) == 4) || (sizeof(Entry) == 8)) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return scanAvx512<Entry>;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return scanAvx2<Entry>;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            return scanSse<Entry>;
+        }
+    }
+#endif
+    return scanScalar<Entry>;
+}
+
+template <typename Entry>
+inline const Entry* scan(const Entry* beg, const Entry* end, typename Entry::id_type value)
+{
+    static const ScanFunc<Entry> f = selectScan<Entry>();
+    return f(beg, end, value);
+}
+
+template <typename Entry>
 class PostingList
 {
 public:
+    using EntryId = typename Entry::id_type;
+
     PostingList(const Entry* begin, const Entry* end)
       : current_(begin)
       , end_(end)
@@ -65,22 +424,58 @@ public:
 
     inline const Entry current() const { return *current_; }
 
+    inline void next() { ++current_; }
+
     inline void skipTo(EntryId id)
     {
-        while ((current_ != end_) && (current().id() < id)) {
-            ++current_;
-        }
+        [[maybe_unused]] const Entry* from = current_;
+        seek(id);
+        KINDEX_COUNT(skipTos, 1);
+        KINDEX_COUNT(skipped, current_ - from);
     }
 
 private:
+    // Gallops over long skips, narrows the window holding the target by binary search and scans the rest.
+    inline void seek(EntryId id)
+    {
+        if ((current_ == end_) || (current().id() >= id)) {
+            return;
+        }
+
+        auto value = Entry{ id, false }.value();
+        const Entry* lo = current_ + 1;
+        if ((lo == end_) || !(lo->value() < value)) {
+            current_ = lo;
+            return;
+        }
+        size_t step = 8;
+        while ((static_cast<size_t>(end_ - lo) > step) && (lo[step].value() < value)) {
+            lo += step + 1;
+            step *= 2;
+        }
+        const Entry* hi = lo + std::min<size_t>(step, end_ - lo);
+        while (hi - lo > 32) {
+            const Entry* mid = lo + (hi - lo) / 2;
+            if (mid->value() < value) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        current_ = scan(lo, hi, value);
+    }
+
     const Entry* current_;
 
     const Entry* end_;
 };
 
+template <typename Entry>
 class PostingListGroup
 {
 public:
+    using EntryId = typename Entry::id_type;
+
     PostingListGroup()
       : current_(Entry::max())
     {
@@ -88,7 +483,7 @@ public:
 
     inline bool operator<(const PostingListGroup& other) const { return current() < other.current(); }
 
-    void add(PostingList plist)
+    void add(PostingList<Entry> plist)
     {
         if (plist.empty()) {
             return;
@@ -103,6 +498,8 @@ public:
 
     inline const Entry current() const { return current_; }
 
+    inline const std::vector<PostingList<Entry>>& lists() const { return plists_; }
+
     inline void skipTo(EntryId id)
     {
         if (current_ == Entry::max()) {
@@ -129,255 +526,1849 @@ public:
 private:
     Entry current_;
 
-    std::vector<PostingList> plists_;
+    std::vector<PostingList<Entry>> plists_;
 };
 
-template <typename Key, typename T>
-class InvertedIndexImpl
+// A posting list stored in the entry arena of its Indexer.
+struct ListSpan
 {
-public:
-    template <typename Iter>
-    void addEntry(Entry entry, const Key& key, Iter beg, Iter end)
-    {
-        auto& t = indexs_[key];
-        for (; beg != end; ++beg) {
-            t[*beg].push_back(entry);
-        }
-    }
+    uint64_t offset = 0;
+    uint64_t size = 0;
 
-    template <typename Iter>
-    void trigger(PostingListGroup& group, const Key& key, Iter beg, Iter end) const
+    template <typename Entry>
+    inline PostingList<Entry> list(const Entry* base) const
     {
-        auto iter = indexs_.find(key);
-        if (iter == indexs_.end()) {
-            return;
-        }
-
-        for (; beg != end; ++beg) {
-            auto iter2 = iter->second.find(*beg);
-            if (iter2 == iter->second.end()) {
-                continue;
-            }
-            group.add(PostingList{ iter2->second.data(), iter2->second.data() + iter2->second.size() });
-        }
-    }
-
-    void build()
-    {
-        for (auto& i : indexs_) {
-            for (auto& j : i.second) {
-                std::sort(j.second.begin(), j.second.end());
-            }
-        }
+        return PostingList<Entry>{ base + offset, base + offset + size };
     }
+};
 
-private:
-    std::unordered_map<Key, std::unordered_map<T, std::vector<Entry>>> indexs_;
+// A posting list of one (key, value) in one shard and size partition.
+struct ListRef
+{
+    uint32_t shard;
+    uint32_t partition;
+    ListSpan span;
 };
 
-template <typename Key>
-class InvertedIndex
+// Numbers the queries of the calling thread, starting at 1.
+inline uint64_t nextQuery()
+{
+    static thread_local uint64_t queries = 0;
+    return ++queries;
+}
+
+// A direct-mapped cache of the groups of keys triggered with several values. Once the same values of a key were
+// looked up `threshold` times, the union of their lists in every shard and partition is merged into one list, which
+// the key's group then holds instead of one list per value. Every slot is tagged with the generation of the index that
+// filled it, so lookups of another index, or of the same index after its lists changed, miss; generation 0 is never
+// used. Slots are also tagged with the last query using them: its groups point into the slot, so no other key of that
+// query may take it over.
+template <typename Key, typename T, typename Entry>
+class UnionCache
 {
 public:
-    template <typename Iter>
-    inline void addEntry(Entry entry, const Key& key, Iter beg, Iter end)
+    struct Slot
     {
-        using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*beg)>>;
-
-        static_assert(std::is_integral_v<value_type> || std::is_same_v<value_type, std::string>, "unsupport type");
-
-        if constexpr (std::is_same_v<value_type, std::string>) {
-            stringIndex_.addEntry(entry, key, beg, end);
-        } else if constexpr (std::is_integral_v<value_type>) {
-            intIndex_.addEntry(entry, key, beg, end);
+        uint64_t generation = 0;
+        uint64_t query = 0;
+        Key key{};
+        std::vector<T> values;
+        uint64_t uses = 0;
+        bool merged = false;
+        // Spans into entries.
+        std::vector<ListRef> refs;
+        std::vector<Entry> entries;
+    };
+
+    void resize(size_t size)
+    {
+        size = std::bit_ceil(std::max<size_t>(size, 1));
+        if (slots_.size() != size) {
+            slots_.clear();
+            slots_.resize(size);
         }
     }
 
-    template <typename Iter>
-    void trigger(PostingListGroup& group, const Key& key, Iter beg, Iter end) const
+    // Returns the slot of (key, values), which must be sorted and distinct, or null if another key of the query holds
+    // it.
+    Slot* get(uint64_t generation, uint64_t query, const Key& key, const std::vector<T>& values)
     {
-        using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*beg)>>;
-
-        static_assert(std::is_integral_v<value_type> || std::is_same_v<value_type, std::string>, "unsupport type");
-
-        if constexpr (std::is_same_v<value_type, std::string>) {
-            stringIndex_.trigger(group, key, beg, end);
-        } else if constexpr (std::is_integral_v<value_type>) {
-            intIndex_.trigger(group, key, beg, end);
+        size_t h = std::hash<Key>{}(key);
+        for (auto& v : values) {
+            h ^= std::hash<T>{}(v) + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+        }
+        auto& slot = slots_[h & (slots_.size() - 1)];
+        if ((slot.generation == generation) && (slot.key == key) && (slot.values == values)) {
+            slot.query = query;
+            ++slot.uses;
+            return &slot;
         }
+        if (slot.query == query) {
+            return nullptr;
+        }
+        slot.generation = generation;
+        slot.query = query;
+        slot.key = key;
+        slot.values = values;
+        slot.uses = 1;
+        slot.merged = false;
+        slot.refs.clear();
+        slot.entries.clear();
+        return &slot;
     }
 
-    void build()
+    // Merges the lists of refs, which may be reordered, per shard and partition into the slot. Entries of one
+    // conjunction found in several lists are kept once; a group only looks at its smallest current entry.
+    static void merge(Slot& slot, std::vector<ListRef>& refs, const std::vector<const Entry*>& bases)
     {
-        intIndex_.build();
-        stringIndex_.build();
+        std::sort(refs.begin(), refs.end(), [](const ListRef& a, const ListRef& b) {
+            return std::tie(a.shard, a.partition) < std::tie(b.shard, b.partition);
+        });
+        for (size_t i = 0; i < refs.size();) {
+            size_t offset = slot.entries.size();
+            size_t j = i;
+            for (; (j < refs.size()) && (refs[j].shard == refs[i].shard) && (refs[j].partition == refs[i].partition);
+                 ++j) {
+                const Entry* base = bases[refs[j].shard] + refs[j].span.offset;
+                size_t middle = slot.entries.size();
+                slot.entries.insert(slot.entries.end(), base, base + refs[j].span.size);
+                std::inplace_merge(slot.entries.begin() + offset, slot.entries.begin() + middle, slot.entries.end());
+            }
+            slot.entries.erase(std::unique(slot.entries.begin() + offset, slot.entries.end()), slot.entries.end());
+            slot.refs.push_back(ListRef{ refs[i].shard, refs[i].partition,
+                                         ListSpan{ offset, slot.entries.size() - offset } });
+            i = j;
+        }
+        slot.merged = true;
     }
 
 private:
-    InvertedIndexImpl<Key, int64_t> intIndex_;
-    InvertedIndexImpl<Key, std::string> stringIndex_;
-};
-
-} // namespace detail
-
-template <typename Key>
-struct Expression
-{
-    Key key;
-    std::variant<std::vector<std::string>, std::vector<int64_t>> values;
-    bool positive;
+    std::vector<Slot> slots_;
 };
 
-template <typename Key>
-struct Conjunction
-{
-    std::vector<Expression<Key>> expressions;
-};
+// Serialized index layout, all fields 64-bit words in native byte order:
+//   header   magic, version, flags, checksum of the body, main section size, string section size
+//   main     fixed size records; strings are stored as (offset, length) into the string section, entry arrays are
+//            aligned to the entry size relative to the start of the body
+//   strings  the bytes of every string key and value
+// Keys and values are written in sorted order, so the file can be searched in place.
+constexpr char formatMagic[8] = { 'K', 'I', 'N', 'D', 'E', 'X', '\0', '\0' };
+constexpr uint64_t formatVersion = 4;
 
-template <typename Key>
-struct Document
+struct FileHeader
 {
-    std::vector<Conjunction<Key>> conjunctions;
+    char magic[8];
+    uint64_t version;
+    uint64_t flags;
+    uint64_t checksum;
+    uint64_t mainSize;
+    uint64_t stringSize;
 };
 
-template <typename Key>
-inline size_t getConjunctionSize(const Conjunction<Key>& c)
+inline uint64_t checksum(const char* data, size_t size, uint64_t h = 0xcbf29ce484222325)
 {
-    return std::count_if(c.expressions.begin(), c.expressions.end(),
-                         [](const Expression<Key>& e) { return e.positive; });
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; ++i) {
+        uint64_t w;
+        std::memcpy(&w, data + i * 8, 8);
+        h = (h ^ w) * 0x100000001b3;
+        h ^= h >> 29;
+    }
+    for (size_t i = words * 8; i < size; ++i) {
+        h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001b3;
+    }
+    return h;
 }
 
-class ResultSet
+template <typename T>
+constexpr void assertSerializable()
 {
-public:
-    inline void addDocumentId(uint64_t id) { result_.insert(id); }
-
-    std::unordered_set<uint64_t> result_;
-};
+    static_assert(std::is_integral_v<T> || std::is_same_v<T, std::string>, "unsupport type");
+}
 
-template <typename Key, typename Assignment>
-class Indexer
+class Writer
 {
 public:
-    using expression_type = Expression<Key>;
-    using conjunction_type = Conjunction<Key>;
-    using document_type = Document<Key>;
+    inline void put(uint64_t v) { main_.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
 
-    void retrieve(ResultSet& result, const Assignment& s) const
+    template <typename T>
+    inline void putValue(const T& v)
     {
-        std::vector<detail::PostingListGroup> plists;
-        for (int i = std::min<int>(indexs_.size() - 1, s.size()); i >= 0; --i) {
-            size_t k = i;
-
-            plists.clear();
-            getPostingLists(plists, k, s);
-
-            if (k == 0) {
-                k = 1;
-            }
-
-            if (plists.size() < k) {
-                continue;
-            }
-
-            for (;;) {
-                std::sort(plists.begin(), plists.end());
-
-                if (plists[k - 1].empty()) {
-                    break;
-                }
-
-                uint64_t nextId = 0;
-                if (plists[0].current().id() == plists[k - 1].current().id()) {
-                    if (plists[0].current().isNegative()) {
-                        auto rejectId = plists[0].current().id();
-                        for (size_t l = k; l < plists.size(); ++l) {
-                            if (plists[l].current().id() == rejectId) {
-                                plists[l].skipTo(rejectId + 1);
-                            } else {
-                                break;
-                            }
-                        }
-                        // continue;
-                    } else {
-                        auto e = plists[k - 1].current();
-                        auto docId = e.documentId();
-                        result.addDocumentId(docId);
-                    }
-                    nextId = plists[k - 1].current().id() + 1;
-                } else {
-                    nextId = plists[k - 1].current().id();
-                }
-
-                for (size_t l = 0; l < k; ++l) {
-                    plists[l].skipTo(nextId);
-                }
-            }
+        assertSerializable<T>();
+
+        if constexpr (std::is_same_v<T, std::string>) {
+            put(strings_.size());
+            put(v.size());
+            strings_.append(v);
+        } else {
+            put(static_cast<uint64_t>(v));
         }
     }
 
-    inline static Indexer create(const std::vector<document_type>& documents)
+    template <typename Entry>
+    inline void putEntries(const Entry* entries, size_t size)
     {
-        Indexer indexer;
-        indexer.build(documents);
-        return indexer;
+        main_.resize((main_.size() + alignof(Entry) - 1) / alignof(Entry) * alignof(Entry), '\0');
+        main_.append(reinterpret_cast<const char*>(entries), size * sizeof(Entry));
     }
 
-private:
-    void build(const std::vector<document_type>& documents)
+    void write(std::ostream& out) const
     {
-        for (uint64_t i = 0; i < documents.size(); ++i) {
-            auto& doc = documents[i];
+        FileHeader header;
+        std::memcpy(header.magic, formatMagic, sizeof(header.magic));
+        header.version = formatVersion;
+        header.flags = 0;
+        header.checksum = checksum(strings_.data(), strings_.size(), checksum(main_.data(), main_.size()));
+        header.mainSize = main_.size();
+        header.stringSize = strings_.size();
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(main_.data(), main_.size());
+        out.write(strings_.data(), strings_.size());
+        if (!out) {
+            throw std::runtime_error("kindex: write failed");
+        }
+    }
 
-            if (doc.conjunctions.empty()) {
-                continue;
-            }
+private:
+    std::string main_;
 
-            for (uint64_t j = 0; j < (uint64_t)doc.conjunctions.size(); ++j) {
-                auto& conjunction = doc.conjunctions[j];
-                size_t size = getConjunctionSize(conjunction);
-                for (auto& expr : conjunction.expressions) {
-                    detail::Entry entry{ i, j, expr.positive };
-                    if (indexs_.size() < size + 1) {
-                        indexs_.resize(size + 1);
-                    }
-                    std::visit([&](auto&& v) { indexs_[size].addEntry(entry, expr.key, v.begin(), v.end()); },
-                               expr.values);
-                }
+    std::string strings_;
+};
 
-                if (size == 0) {
-                    z_.push_back(detail::Entry{ i, j, true });
-                }
+class Reader
+{
+public:
+    Reader(const char* main, size_t mainSize, const char* strings, size_t stringSize)
+      : begin_(main)
+      , current_(main)
+      , end_(main + mainSize)
+      , strings_(strings)
+      , stringSize_(stringSize)
+    {
+    }
+
+    // Checks the header of a serialized index and returns a reader over its body, which must follow the header.
+    static Reader open(const FileHeader& header, const char* body, size_t bodySize, bool verify = true)
+    {
+        if (std::memcmp(header.magic, formatMagic, sizeof(header.magic)) != 0) {
+            throw std::runtime_error("kindex: not an index file");
+        }
+        if (header.version != formatVersion) {
+            throw std::runtime_error("kindex: unsupported index format version " + std::to_string(header.version));
+        }
+        if (header.flags != 0) {
+            throw std::runtime_error("kindex: unsupported index flags");
+        }
+        if ((header.mainSize > bodySize) || (header.stringSize != bodySize - header.mainSize)) {
+            throw std::runtime_error("kindex: truncated index file");
+        }
+        if (verify &&
+            (checksum(body + header.mainSize, header.stringSize, checksum(body, header.mainSize)) != header.checksum)) {
+            throw std::runtime_error("kindex: index checksum mismatch");
+        }
+        return Reader{ body, header.mainSize, body + header.mainSize, header.stringSize };
+    }
+
+    inline const char* take(size_t size)
+    {
+        if (size > static_cast<size_t>(end_ - current_)) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+        auto* p = current_;
+        current_ += size;
+        return p;
+    }
+
+    inline uint64_t get()
+    {
+        uint64_t v;
+        std::memcpy(&v, take(sizeof(v)), sizeof(v));
+        return v;
+    }
+
+    template <typename T>
+    inline T getValue()
+    {
+        assertSerializable<T>();
+
+        if constexpr (std::is_same_v<T, std::string>) {
+            uint64_t offset = get();
+            return T{ string(offset, get()) };
+        } else {
+            return static_cast<T>(get());
+        }
+    }
+
+    // Reads a record count, checking that that many records of at least recordSize bytes can follow.
+    inline uint64_t getCount(size_t recordSize)
+    {
+        uint64_t count = get();
+        if (count > static_cast<size_t>(end_ - current_) / recordSize) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+        return count;
+    }
+
+    inline std::string_view string(uint64_t offset, uint64_t size) const
+    {
+        if ((offset > stringSize_) || (size > stringSize_ - offset)) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+        return std::string_view{ strings_ + offset, size };
+    }
+
+    template <typename Entry>
+    inline const Entry* getEntries(size_t size)
+    {
+        if (size > std::numeric_limits<size_t>::max() / sizeof(Entry)) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+        take((alignof(Entry) - (current_ - begin_) % alignof(Entry)) % alignof(Entry));
+        return reinterpret_cast<const Entry*>(take(size * sizeof(Entry)));
+    }
+
+    // Checks that a span read from the file lies inside an arena of the given size.
+    inline static void check(const ListSpan& span, uint64_t entries)
+    {
+        if ((span.offset > entries) || (span.size > entries - span.offset)) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+    }
+
+private:
+    const char* begin_;
+
+    const char* current_;
+
+    const char* end_;
+
+    const char* strings_;
+
+    size_t stringSize_;
+};
+
+// With exactly K triggered keys, each a single posting list, a conjunction of size K matches iff every list holds it
+// and no list starts its entries for it with a negative one. Leapfrogs the lists to the next common id instead of
+// sorting them.
+template <size_t K, typename Entry, typename Emit>
+void intersect(const std::vector<PostingListGroup<Entry>>& groups, typename Entry::id_type begin,
+               typename Entry::id_type end, Emit&& emit)
+{
+    PostingList<Entry> lists[K];
+    for (size_t l = 0; l < K; ++l) {
+        lists[l] = groups[l].lists().front();
+    }
+
+    if constexpr (K == 1) {
+        auto& list = lists[0];
+        for (list.skipTo(begin); !list.empty() && (list.current().id() < end);) {
+            auto current = list.current();
+            if (!current.isNegative()) {
+                emit(current);
+            } else {
+                KINDEX_COUNT(rejections, 1);
+            }
+            list.skipTo(current.id() + 1);
+        }
+        return;
+    }
+
+    typename Entry::id_type id = begin;
+    for (;;) {
+        bool common = true;
+        for (size_t l = 0; l < K; ++l) {
+            lists[l].skipTo(id);
+            if (lists[l].empty()) {
+                return;
+            }
+            if (lists[l].current().id() != id) {
+                id = lists[l].current().id();
+                common = false;
+                break;
+            }
+        }
+        if (id >= end) {
+            return;
+        }
+        if (!common) {
+            continue;
+        }
+
+        bool positive = true;
+        for (size_t l = 0; l < K; ++l) {
+            positive = positive && !lists[l].current().isNegative();
+        }
+        if (positive) {
+            emit(lists[K - 1].current());
+        } else {
+            KINDEX_COUNT(rejections, 1);
+        }
+        ++id;
+    }
+}
+
+// The sort-and-skip loop of match for a size known at compile time. The groups are sorted once; each step only moves
+// the groups it advanced, which are a prefix, back into the still sorted rest.
+template <size_t K, typename Entry, typename Emit>
+void match(PostingListGroup<Entry>* groups, size_t n, typename Entry::id_type begin, typename Entry::id_type end,
+           Emit&& emit)
+{
+    if (begin != 0) {
+        for (size_t l = 0; l < n; ++l) {
+            groups[l].skipTo(begin);
+        }
+    }
+    std::sort(groups, groups + n);
+    KINDEX_COUNT(sorts, 1);
+
+    for (;;) {
+        auto current = groups[K - 1].current();
+        if (groups[K - 1].empty() || (current.id() >= end)) {
+            break;
+        }
+
+        size_t advanced = K;
+        typename Entry::id_type nextId = current.id();
+        if (groups[0].current().id() == current.id()) {
+            if (groups[0].current().isNegative()) {
+                KINDEX_COUNT(rejections, 1);
+                while ((advanced < n) && (groups[advanced].current().id() == current.id())) {
+                    groups[advanced++].skipTo(current.id() + 1);
+                }
+            } else {
+                emit(current);
+            }
+            nextId = current.id() + 1;
+        }
+
+        for (size_t l = 0; l < K; ++l) {
+            groups[l].skipTo(nextId);
+        }
+
+        for (size_t l = advanced; l-- > 0;) {
+            for (size_t j = l; (j + 1 < n) && (groups[j + 1] < groups[j]); ++j) {
+                std::swap(groups[j], groups[j + 1]);
+            }
+        }
+    }
+}
+
+// Sizes up to this use the compile-time specializations of match.
+constexpr size_t maxFixedK = 8;
+
+template <size_t K = 1, typename Entry, typename Emit>
+void matchFixed(size_t k, std::vector<PostingListGroup<Entry>>& plists, typename Entry::id_type begin,
+                typename Entry::id_type end, Emit&& emit)
+{
+    if constexpr (K < maxFixedK) {
+        if (k != K) {
+            return matchFixed<K + 1>(k, plists, begin, end, emit);
+        }
+    }
+    match<K>(plists.data(), plists.size(), begin, end, emit);
+}
+
+// Size 0 conjunctions match unless a triggered key excludes them. Their triggered lists only hold negative entries,
+// usually few, so the excluded ids are collected and z is walked once instead of being skipped through in step with
+// them.
+template <typename Entry, typename Emit>
+void matchZero(const std::vector<PostingListGroup<Entry>>& plists, typename Entry::id_type begin,
+               typename Entry::id_type end, Emit&& emit)
+{
+    if (plists.empty() || plists.back().empty()) {
+        return;
+    }
+    auto z = plists.back().lists().front();
+    z.skipTo(begin);
+    if (z.empty() || (z.current().id() >= end)) {
+        return;
+    }
+
+    std::vector<typename Entry::id_type> excluded;
+    for (size_t l = 0; l + 1 < plists.size(); ++l) {
+        for (auto plist : plists[l].lists()) {
+            for (plist.skipTo(begin); !plist.empty() && (plist.current().id() < end); plist.next()) {
+                if (plist.current().isNegative()) {
+                    excluded.push_back(plist.current().id());
+                }
+            }
+        }
+    }
+    std::sort(excluded.begin(), excluded.end());
+    KINDEX_COUNT(sorts, 1);
+
+    auto ex = excluded.begin();
+    for (; !z.empty() && (z.current().id() < end); z.next()) {
+        auto id = z.current().id();
+        while ((ex != excluded.end()) && (*ex < id)) {
+            ++ex;
+        }
+        if ((ex == excluded.end()) || (*ex != id)) {
+            emit(z.current());
+        } else {
+            KINDEX_COUNT(rejections, 1);
+        }
+    }
+}
+
+// Matches the conjunctions of size k whose entry ids fall in [begin, end) against the triggered posting lists and
+// calls emit(entry) with an entry of every matching conjunction. For k == 0 the last group is the z list.
+template <typename Entry, typename Emit>
+void match(std::vector<PostingListGroup<Entry>>& plists, size_t k, typename Entry::id_type begin,
+           typename Entry::id_type end, Emit&& emit)
+{
+    if (k == 0) {
+        return matchZero(plists, begin, end, emit);
+    }
+
+    if (plists.size() < k) {
+        return;
+    }
+
+    if ((plists.size() == k) && (k <= 3) &&
+        std::all_of(plists.begin(), plists.end(), [](auto& g) { return g.lists().size() == 1; })) {
+        switch (k) {
+        case 1:
+            return intersect<1>(plists, begin, end, emit);
+        case 2:
+            return intersect<2>(plists, begin, end, emit);
+        default:
+            return intersect<3>(plists, begin, end, emit);
+        }
+    }
+
+    if (k <= maxFixedK) {
+        return matchFixed(k, plists, begin, end, emit);
+    }
+
+    if (begin != 0) {
+        for (auto& plist : plists) {
+            plist.skipTo(begin);
+        }
+    }
+
+    for (;;) {
+        std::sort(plists.begin(), plists.end());
+        KINDEX_COUNT(sorts, 1);
+
+        if (plists[k - 1].empty() || (plists[k - 1].current().id() >= end)) {
+            break;
+        }
+
+        typename Entry::id_type nextId = 0;
+        if (plists[0].current().id() == plists[k - 1].current().id()) {
+            if (plists[0].current().isNegative()) {
+                KINDEX_COUNT(rejections, 1);
+                auto rejectId = plists[0].current().id();
+                for (size_t l = k; l < plists.size(); ++l) {
+                    if (plists[l].current().id() == rejectId) {
+                        plists[l].skipTo(rejectId + 1);
+                    } else {
+                        break;
+                    }
+                }
+                // continue;
+            } else {
+                emit(plists[k - 1].current());
+            }
+            nextId = plists[k - 1].current().id() + 1;
+        } else {
+            nextId = plists[k - 1].current().id();
+        }
+
+        for (size_t l = 0; l < k; ++l) {
+            plists[l].skipTo(nextId);
+        }
+    }
+}
+
+template <typename Key, typename T>
+class InvertedIndexImpl
+{
+public:
+    template <typename Iter, typename Func>
+    void addEntry(const Key& key, Iter beg, Iter end, Func&& f)
+    {
+        auto& t = indexs_[key];
+        for (; beg != end; ++beg) {
+            f(t[*beg]);
+        }
+    }
+
+    // Calls f(span) for every value in [beg, end) the key has a span for.
+    template <typename Iter, typename Func>
+    void find(const Key& key, Iter beg, Iter end, Func&& f) const
+    {
+        auto iter = indexs_.find(key);
+        if (iter == indexs_.end()) {
+            return;
+        }
+
+        for (; beg != end; ++beg) {
+            auto iter2 = iter->second.find(*beg);
+            if (iter2 == iter->second.end()) {
+                continue;
+            }
+            f(iter2->second);
+        }
+    }
+
+    // Calls f(local, global) for every list of other, creating the global list if needed.
+    template <typename Func>
+    void merge(InvertedIndexImpl& other, Func&& f)
+    {
+        for (auto& i : other.indexs_) {
+            auto& t = indexs_[i.first];
+            for (auto& j : i.second) {
+                f(j.second, t[j.first]);
+            }
+        }
+    }
+
+    template <typename Func>
+    void forEach(Func&& f)
+    {
+        for (auto& i : indexs_) {
+            for (auto& j : i.second) {
+                f(i.first, j.first, j.second);
+            }
+        }
+    }
+
+    template <typename Func>
+    void forEach(Func&& f) const
+    {
+        for (auto& i : indexs_) {
+            for (auto& j : i.second) {
+                f(i.first, j.first, j.second);
+            }
+        }
+    }
+
+    inline size_t keys() const { return indexs_.size(); }
+
+    // Estimated heap bytes of the maps: a pointer per bucket, and per element a node holding the element, the link to
+    // the next node and the cached hash, plus the contents of strings too long for the small string buffer.
+    uint64_t bytes() const
+    {
+        auto heap = [](const auto& v) -> uint64_t {
+            if constexpr (std::is_same_v<std::remove_cv_t<std::remove_reference_t<decltype(v)>>, std::string>) {
+                return (v.capacity() > std::string{}.capacity()) ? v.capacity() + 1 : 0;
+            } else {
+                return 0;
+            }
+        };
+
+        uint64_t bytes = indexs_.bucket_count() * sizeof(void*);
+        for (auto& i : indexs_) {
+            bytes += sizeof(i) + 2 * sizeof(void*) + heap(i.first) + i.second.bucket_count() * sizeof(void*);
+            for (auto& j : i.second) {
+                bytes += sizeof(j) + 2 * sizeof(void*) + heap(j.first);
+            }
+        }
+        return bytes;
+    }
+
+    // Copies the live entries of every list to out and drops the lists left empty.
+    template <typename Entry, typename Pred>
+    void compact(const Entry* base, std::vector<Entry>& out, Pred&& isDead)
+    {
+        for (auto i = indexs_.begin(); i != indexs_.end();) {
+            for (auto j = i->second.begin(); j != i->second.end();) {
+                auto& span = j->second;
+                uint64_t offset = out.size();
+                std::copy_if(base + span.offset, base + span.offset + span.size, std::back_inserter(out),
+                             [&](Entry e) { return !isDead(e); });
+                span = ListSpan{ offset, out.size() - offset };
+                if (span.size == 0) {
+                    j = i->second.erase(j);
+                } else {
+                    ++j;
+                }
+            }
+            if (i->second.empty()) {
+                i = indexs_.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    // Writes the keys in order, each with the range of its value records, then the values of every key in order.
+    void save(Writer& w) const
+    {
+        std::vector<const typename decltype(indexs_)::value_type*> keys;
+        for (auto& i : indexs_) {
+            keys.push_back(&i);
+        }
+        std::sort(keys.begin(), keys.end(), [](auto a, auto b) { return a->first < b->first; });
+
+        uint64_t values = 0;
+        for (auto* i : keys) {
+            values += i->second.size();
+        }
+        w.put(keys.size());
+        w.put(values);
+
+        values = 0;
+        for (auto* i : keys) {
+            w.putValue(i->first);
+            w.put(values);
+            w.put(i->second.size());
+            values += i->second.size();
+        }
+
+        std::vector<const typename std::unordered_map<T, ListSpan>::value_type*> lists;
+        for (auto* i : keys) {
+            lists.clear();
+            for (auto& j : i->second) {
+                lists.push_back(&j);
+            }
+            std::sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->first < b->first; });
+            for (auto* j : lists) {
+                w.putValue(j->first);
+                w.put(j->second.offset);
+                w.put(j->second.size);
+            }
+        }
+    }
+
+    void load(Reader& r, uint64_t entries)
+    {
+        uint64_t keyCount = r.getCount(3 * sizeof(uint64_t));
+        uint64_t valueCount = r.getCount(3 * sizeof(uint64_t));
+
+        std::vector<std::pair<Key, uint64_t>> keys;
+        uint64_t values = 0;
+        for (uint64_t i = 0; i < keyCount; ++i) {
+            Key key = r.getValue<Key>();
+            if (r.get() != values) {
+                throw std::runtime_error("kindex: corrupt index file");
+            }
+            uint64_t size = r.get();
+            values += size;
+            keys.emplace_back(std::move(key), size);
+        }
+        if (values != valueCount) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+
+        for (auto& i : keys) {
+            auto& t = indexs_[i.first];
+            for (uint64_t j = 0; j < i.second; ++j) {
+                T value = r.getValue<T>();
+                ListSpan span{ r.get(), r.get() };
+                Reader::check(span, entries);
+                t.emplace(std::move(value), span);
+            }
+        }
+    }
+
+private:
+    std::unordered_map<Key, std::unordered_map<T, ListSpan>> indexs_;
+};
+
+template <typename Key>
+class InvertedIndex
+{
+public:
+    template <typename Iter, typename Func>
+    inline void addEntry(const Key& key, Iter beg, Iter end, Func&& f)
+    {
+        using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*beg)>>;
+
+        static_assert(std::is_integral_v<value_type> || std::is_same_v<value_type, std::string>, "unsupport type");
+
+        if constexpr (std::is_same_v<value_type, std::string>) {
+            stringIndex_.addEntry(key, beg, end, f);
+        } else if constexpr (std::is_integral_v<value_type>) {
+            intIndex_.addEntry(key, beg, end, f);
+        }
+    }
+
+    template <typename Iter, typename Func>
+    void find(const Key& key, Iter beg, Iter end, Func&& f) const
+    {
+        using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*beg)>>;
+
+        static_assert(std::is_integral_v<value_type> || std::is_same_v<value_type, std::string>, "unsupport type");
+
+        if constexpr (std::is_same_v<value_type, std::string>) {
+            stringIndex_.find(key, beg, end, f);
+        } else if constexpr (std::is_integral_v<value_type>) {
+            intIndex_.find(key, beg, end, f);
+        }
+    }
+
+    template <typename Func>
+    void merge(InvertedIndex& other, Func&& f)
+    {
+        intIndex_.merge(other.intIndex_, f);
+        stringIndex_.merge(other.stringIndex_, f);
+    }
+
+    template <typename Func>
+    void forEach(Func&& f)
+    {
+        intIndex_.forEach(f);
+        stringIndex_.forEach(f);
+    }
+
+    template <typename Func>
+    void forEach(Func&& f) const
+    {
+        intIndex_.forEach(f);
+        stringIndex_.forEach(f);
+    }
+
+    // Keys with integer and with string values are counted once for each.
+    inline size_t keys() const { return intIndex_.keys() + stringIndex_.keys(); }
+
+    inline uint64_t bytes() const { return intIndex_.bytes() + stringIndex_.bytes(); }
+
+    template <typename Entry, typename Pred>
+    void compact(const Entry* base, std::vector<Entry>& out, Pred&& isDead)
+    {
+        intIndex_.compact(base, out, isDead);
+        stringIndex_.compact(base, out, isDead);
+    }
+
+    void save(Writer& w) const
+    {
+        intIndex_.save(w);
+        stringIndex_.save(w);
+    }
+
+    void load(Reader& r, uint64_t entries)
+    {
+        intIndex_.load(r, entries);
+        stringIndex_.load(r, entries);
+    }
+
+private:
+    InvertedIndexImpl<Key, int64_t> intIndex_;
+    InvertedIndexImpl<Key, std::string> stringIndex_;
+};
+
+} // namespace detail
+
+template <typename Key>
+struct Expression
+{
+    Key key;
+    std::variant<std::vector<std::string>, std::vector<int64_t>> values;
+    bool positive;
+};
+
+template <typename Key>
+struct Conjunction
+{
+    std::vector<Expression<Key>> expressions;
+};
+
+template <typename Key>
+struct Document
+{
+    std::vector<Conjunction<Key>> conjunctions;
+};
+
+template <typename Key>
+inline size_t getConjunctionSize(const Conjunction<Key>& c)
+{
+    return std::count_if(c.expressions.begin(), c.expressions.end(),
+                         [](const Expression<Key>& e) { return e.positive; });
+}
+
+class ResultSet
+{
+public:
+    inline void addDocumentId(uint64_t id) { result_.insert(id); }
+
+    // Merges the documents of other, not its stats.
+    inline void merge(const ResultSet& other) { result_.insert(other.result_.begin(), other.result_.end()); }
+
+    std::unordered_set<uint64_t> result_;
+
+    // The work of the retrieves into this result.
+    RetrieveStats stats_;
+};
+
+struct BuildOptions
+{
+    // Documents are split into this many contiguous ranges that are indexed concurrently.
+    size_t threads = 1;
+
+    // Number of conjunction id ranges indexed as independent shards, each with its own posting lists and arena.
+    size_t shards = 1;
+
+    // Index conjunctions shared by several documents, up to the order of expressions and values, only once.
+    bool deduplicate = true;
+
+    // Renumber the conjunctions so that those with the same positive expressions get adjacent ids, which clusters
+    // the entries of every posting list. Result document ids are not affected.
+    bool reorder = false;
+};
+
+// The lists of one conjunction size, summed over the shards.
+struct PartitionStats
+{
+    // Keys with lists, counted once per shard.
+    uint64_t keys = 0;
+
+    // Posting lists, one for every (key, value) in every shard holding it.
+    uint64_t lists = 0;
+
+    uint64_t entries = 0;
+
+    // lengths[i] lists hold [2^i, 2^(i + 1)) entries.
+    std::vector<uint64_t> lengths;
+};
+
+struct IndexStats
+{
+    // By conjunction size.
+    std::vector<PartitionStats> partitions;
+
+    // Entries of the z lists, one for every conjunction without positive expressions.
+    uint64_t zEntries = 0;
+
+    // The entry arenas of the shards, holding every posting list.
+    uint64_t entryBytes = 0;
+
+    // Estimated heap bytes of the hash maps of the partitions.
+    uint64_t partitionBytes = 0;
+
+    // Estimated heap bytes of the lookup dictionary and the list references it points to.
+    uint64_t dictionaryBytes = 0;
+
+    // The conjunction to document tables and the removed documents.
+    uint64_t documentBytes = 0;
+};
+
+template <typename Key, typename Assignment, typename Word = uint64_t>
+class Indexer
+{
+    using Entry = detail::BasicEntry<Word>;
+    using EntryId = Word;
+    using PostingListGroup = detail::PostingListGroup<Entry>;
+
+public:
+    using expression_type = Expression<Key>;
+    using conjunction_type = Conjunction<Key>;
+    using document_type = Document<Key>;
+
+    void retrieve(ResultSet& result, const Assignment& s) const
+    {
+        detail::StatsScope scope{ result.stats_ };
+        std::vector<std::vector<PostingListGroup>> plists;
+        getPostingLists(plists, s);
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            for (size_t k = shards_[i].partitions(); k-- > 0;) {
+                if (!plists[slots_[i] + k].empty()) {
+                    KINDEX_COUNT(partitions, 1);
+                    retrieve(result, plists[slots_[i] + k], k, 0, Entry::max().id());
+                }
             }
         }
+    }
 
-        for (auto& i : indexs_) {
-            i.build();
+    // Splits every size partition of every shard into `ranges` conjunction id ranges and runs them as tasks on the
+    // executor, which is anything with execute(std::function<void()>) running the task on another thread. Posting
+    // lists are looked up on the calling thread, which then blocks until all tasks are done, so it must not be a
+    // thread of the executor. A ranges of 0 is taken as 1. The first exception thrown by a task, or by execute, is
+    // rethrown once every scheduled task has finished.
+    template <typename Executor>
+    void retrieve(ResultSet& result, const Assignment& s, Executor& executor, size_t ranges = 1) const
+    {
+        ranges = std::max<size_t>(ranges, 1);
+
+        struct Task
+        {
+            const Shard* shard;
+            size_t k;
+            std::vector<PostingListGroup> plists;
+        };
+
+        std::vector<Task> tasks;
+        std::vector<std::vector<PostingListGroup>> plists;
+        {
+            detail::StatsScope scope{ result.stats_ };
+            getPostingLists(plists, s);
+            for (size_t i = 0; i < shards_.size(); ++i) {
+                for (size_t k = shards_[i].partitions(); k-- > 0;) {
+                    if (!plists[slots_[i] + k].empty()) {
+                        KINDEX_COUNT(partitions, 1);
+                        tasks.push_back(Task{ &shards_[i], k, std::move(plists[slots_[i] + k]) });
+                    }
+                }
+            }
+        }
+        if (tasks.empty()) {
+            return;
+        }
+
+        struct CountDown
+        {
+            std::latch& latch;
+
+            ~CountDown() { latch.count_down(); }
+        };
+
+        std::vector<ResultSet> results(tasks.size() * ranges);
+        std::vector<std::exception_ptr> errors(results.size() + 1);
+        std::latch done{ static_cast<std::ptrdiff_t>(results.size()) };
+        size_t scheduled = 0;
+        try {
+            for (; scheduled < results.size(); ++scheduled) {
+                executor.execute([&, t = scheduled / ranges, r = scheduled % ranges]() {
+                    CountDown countDown{ done };
+                    try {
+                        auto& task = tasks[t];
+                        auto plists = task.plists;
+                        uint64_t size = task.shard->end() - task.shard->begin();
+                        EntryId begin = task.shard->begin() + size * r / ranges;
+                        EntryId end = Entry::max().id();
+                        if (r + 1 < ranges) {
+                            end = task.shard->begin() + size * (r + 1) / ranges;
+                        }
+                        detail::StatsScope scope{ results[t * ranges + r].stats_ };
+                        retrieve(results[t * ranges + r], plists, task.k, begin, end);
+                    } catch (...) {
+                        errors[t * ranges + r] = std::current_exception();
+                    }
+                });
+            }
+        } catch (...) {
+            // The tasks never scheduled will not count down.
+            errors.back() = std::current_exception();
+            done.count_down(static_cast<std::ptrdiff_t>(results.size() - scheduled));
+        }
+        done.wait();
+
+        for (auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        for (auto& r : results) {
+            result.merge(r);
+            result.stats_ += r.stats_;
+        }
+    }
+
+    // Number of bits an entry of these documents needs without deduplication, to choose the Word of the index.
+    // create throws std::length_error when the distinct conjunctions need more than the bits of Word.
+    static unsigned entryBits(const std::vector<document_type>& documents)
+    {
+        uint64_t conjunctions = 0;
+        for (auto& doc : documents) {
+            conjunctions += doc.conjunctions.size();
+        }
+        return entryBits(conjunctions);
+    }
+
+    inline static Indexer create(const std::vector<document_type>& documents, const BuildOptions& options = {})
+    {
+        Indexer indexer;
+        indexer.build(documents, options);
+        return indexer;
+    }
+
+    // Writes the built index, removed documents included, in the binary format described at detail::FileHeader.
+    void save(std::ostream& out) const
+    {
+        detail::Writer w;
+        w.put(sizeof(Word));
+        w.put(documentCount_);
+        w.put(removedCount_);
+        w.put(compactedCount_);
+        w.put(removed_.words().size());
+        for (auto word : removed_.words()) {
+            w.put(word);
+        }
+        w.put(conjunctionOffsets_.size());
+        for (auto offset : conjunctionOffsets_) {
+            w.put(offset);
+        }
+        w.put(conjunctionDocuments_.size());
+        for (auto docId : conjunctionDocuments_) {
+            w.put(docId);
+        }
+
+        w.put(shards_.size());
+        for (auto& shard : shards_) {
+            shard.save(w);
+        }
+        w.write(out);
+    }
+
+    // Reads an index written by save. Throws std::runtime_error if the data is truncated, corrupt or was written by
+    // an incompatible version.
+    static Indexer load(std::istream& in)
+    {
+        detail::FileHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            throw std::runtime_error("kindex: truncated index file");
+        }
+        std::string body{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+        auto r = detail::Reader::open(header, body.data(), body.size());
+
+        Indexer indexer;
+        if (r.get() != sizeof(Word)) {
+            throw std::runtime_error("kindex: index file was written with a different entry width");
+        }
+        indexer.documentCount_ = r.get();
+        indexer.removedCount_ = r.get();
+        indexer.compactedCount_ = r.get();
+        indexer.removed_.words().resize(r.getCount(sizeof(uint64_t)));
+        for (auto& word : indexer.removed_.words()) {
+            word = r.get();
+        }
+        if (indexer.removed_.size() < indexer.documentCount_) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+        indexer.conjunctionOffsets_.resize(r.getCount(sizeof(uint64_t)));
+        uint64_t offset = 0;
+        for (auto& o : indexer.conjunctionOffsets_) {
+            o = r.get();
+            if (o < offset) {
+                throw std::runtime_error("kindex: corrupt index file");
+            }
+            offset = o;
+        }
+        indexer.conjunctionDocuments_.resize(r.getCount(sizeof(uint64_t)));
+        for (auto& docId : indexer.conjunctionDocuments_) {
+            docId = r.get();
+            if (docId >= indexer.documentCount_) {
+                throw std::runtime_error("kindex: corrupt index file");
+            }
+        }
+        if (indexer.conjunctionOffsets_.empty() || (indexer.conjunctionOffsets_.front() != 0) ||
+            (indexer.conjunctionOffsets_.back() != indexer.conjunctionDocuments_.size()) ||
+            (indexer.conjunctionOffsets_.size() - 1 > Entry::max().id())) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+
+        indexer.shards_.resize(r.getCount(6 * sizeof(uint64_t)));
+        for (auto& shard : indexer.shards_) {
+            shard.load(r, indexer.conjunctionOffsets_.size() - 1);
+        }
+        indexer.link();
+        return indexer;
+    }
+
+    // Marks a document as removed. Its entries stay in the posting lists and are filtered out by retrieve until the
+    // ratio of removed documents crosses the compaction threshold, then the dead entries are dropped.
+    bool remove(uint64_t docId)
+    {
+        if ((docId >= documentCount_) || removed_.test(docId)) {
+            return false;
+        }
+
+        removed_.set(docId);
+        ++removedCount_;
+
+        if ((removedCount_ - compactedCount_) > compactionThreshold_ * (documentCount_ - compactedCount_)) {
+            compact();
+        }
+        return true;
+    }
+
+    inline bool removed(uint64_t docId) const { return removed_.test(docId); }
+
+    // threshold: ratio of removed but not yet compacted documents to the documents still held by the posting lists.
+    inline void setCompactionThreshold(double threshold) { compactionThreshold_ = threshold; }
+
+    // Walks every posting list, so it costs about as much as a save.
+    IndexStats stats() const
+    {
+        IndexStats stats;
+        for (auto& shard : shards_) {
+            if (stats.partitions.size() < shard.partitions()) {
+                stats.partitions.resize(shard.partitions());
+            }
+            for (size_t k = 0; k < shard.partitions(); ++k) {
+                stats.partitions[k].keys += shard.index(k).keys();
+                stats.partitionBytes += shard.index(k).bytes();
+            }
+            shard.forEach([&](uint32_t k, const auto&, const auto&, const detail::ListSpan& span) {
+                auto& partition = stats.partitions[k];
+                ++partition.lists;
+                partition.entries += span.size;
+                size_t bucket = std::bit_width(std::max<uint64_t>(span.size, 1)) - 1;
+                if (partition.lengths.size() <= bucket) {
+                    partition.lengths.resize(bucket + 1);
+                }
+                ++partition.lengths[bucket];
+            });
+            stats.zEntries += shard.z().size;
+            stats.entryBytes += shard.entryCount() * sizeof(Entry);
+        }
+        stats.dictionaryBytes = dictionary_.bytes() + refs_.size() * sizeof(detail::ListRef);
+        stats.documentBytes = (conjunctionOffsets_.size() + conjunctionDocuments_.size()) * sizeof(uint64_t) +
+                              removed_.words().size() * sizeof(uint64_t);
+        return stats;
+    }
+
+    // Caches up to `size` keys per thread that were triggered with several values, merging the lists of their values
+    // into one list per shard and partition from the `threshold`th lookup of the same values on; 0 disables the
+    // cache. Only the union of one key's lists is merged: lists of different keys are counted as separate groups and
+    // may hold negative entries, so their intersection cannot stand in for them. Build, load and compaction give the
+    // index a new generation, which invalidates its slots.
+    inline void setUnionCache(size_t size, uint64_t threshold = 2)
+    {
+        unionCacheSize_ = size;
+        unionThreshold_ = std::max<uint64_t>(threshold, 1);
+    }
+
+    void compact()
+    {
+        if (removedCount_ == compactedCount_) {
+            return;
+        }
+
+        // A conjunction is dead once every document holding it is removed.
+        detail::Bitmap dead;
+        dead.resize(conjunctionOffsets_.size() - 1);
+        for (uint64_t id = 0; id + 1 < conjunctionOffsets_.size(); ++id) {
+            if (std::all_of(conjunctionDocuments_.begin() + conjunctionOffsets_[id],
+                            conjunctionDocuments_.begin() + conjunctionOffsets_[id + 1],
+                            [this](uint64_t docId) { return removed_.test(docId); })) {
+                dead.set(id);
+            }
+        }
+
+        auto isDead = [&dead](Entry e) { return dead.test(e.id()); };
+        for (auto& shard : shards_) {
+            shard.compact(isDead);
         }
-        std::sort(z_.begin(), z_.end());
+        link();
+
+        compactedCount_ = removedCount_;
     }
 
 private:
-    inline void getPostingLists(std::vector<detail::PostingListGroup>& result, size_t k, const Assignment& s) const
+    // The posting lists of the distinct conjunctions with ids in [begin, end).
+    class Shard
+    {
+        struct BuildPart
+        {
+            uint64_t begin = 0;
+            uint64_t end = 0;
+
+            // Local lists of the part; a ListSpan here holds the local list id and the number of entries.
+            std::vector<detail::InvertedIndex<Key>> indexs;
+
+            // Local list id 0 is the z list.
+            uint64_t zSize = 0;
+            uint32_t listCount = 1;
+
+            // Local list id of every entry, in the order forEachEntry produces them.
+            std::vector<uint32_t> lists;
+
+            // Global list and next arena position by local list id.
+            std::vector<detail::ListSpan*> globals;
+            std::vector<uint64_t> positions;
+        };
+
+    public:
+        inline uint64_t begin() const { return begin_; }
+
+        inline uint64_t end() const { return end_; }
+
+        inline size_t partitions() const { return indexs_.size(); }
+
+        inline const Entry* entries() const { return entries_.data(); }
+
+        inline size_t entryCount() const { return entries_.size(); }
+
+        inline const detail::ListSpan& z() const { return z_; }
+
+        // Counts the entries of every posting list first, so the arena is allocated once and each entry is written
+        // straight to its final position. Parts cover contiguous conjunction id ranges and are laid out in id order,
+        // which leaves the lists sorted.
+        void build(const std::vector<const conjunction_type*>& conjunctions, uint64_t begin, uint64_t end,
+                   size_t threads)
+        {
+            begin_ = begin;
+            end_ = end;
+
+            threads = std::max<size_t>(1, std::min<size_t>(threads, end - begin));
+            std::vector<BuildPart> parts(threads);
+
+            detail::parallelFor(threads, threads, [&](size_t t) {
+                auto& part = parts[t];
+                part.begin = begin + (end - begin) * t / threads;
+                part.end = begin + (end - begin) * (t + 1) / threads;
+                forEachEntry(conjunctions, part.begin, part.end,
+                             [&](size_t size, const expression_type* expr, Entry) {
+                                 if (part.indexs.size() < size + 1) {
+                                     part.indexs.resize(size + 1);
+                                 }
+                                 if (expr == nullptr) {
+                                     ++part.zSize;
+                                     part.lists.push_back(0);
+                                     return;
+                                 }
+                                 std::visit(
+                                   [&](auto&& v) {
+                                       part.indexs[size].addEntry(expr->key, v.begin(), v.end(),
+                                                                  [&](detail::ListSpan& span) {
+                                                                      if (span.size++ == 0) {
+                                                                          span.offset = part.listCount++;
+                                                                      }
+                                                                      part.lists.push_back(span.offset);
+                                                                  });
+                                   },
+                                   expr->values);
+                             });
+            });
+
+            z_ = detail::ListSpan{};
+            std::vector<detail::ListSpan*> lists{ &z_ };
+            for (auto& part : parts) {
+                part.globals.resize(part.listCount);
+                part.positions.resize(part.listCount);
+                part.globals[0] = &z_;
+                part.positions[0] = part.zSize;
+                z_.size += part.zSize;
+
+                if (indexs_.size() < part.indexs.size()) {
+                    indexs_.resize(part.indexs.size());
+                }
+                for (size_t k = 0; k < part.indexs.size(); ++k) {
+                    indexs_[k].merge(part.indexs[k], [&](detail::ListSpan& local, detail::ListSpan& global) {
+                        if (global.size == 0) {
+                            lists.push_back(&global);
+                        }
+                        global.size += local.size;
+                        part.globals[local.offset] = &global;
+                        part.positions[local.offset] = local.size;
+                    });
+                }
+                part.indexs.clear();
+            }
+
+            uint64_t offset = 0;
+            for (auto* span : lists) {
+                span->offset = offset;
+                offset += span->size;
+                span->size = 0;
+            }
+            for (auto& part : parts) {
+                for (uint32_t i = 0; i < part.listCount; ++i) {
+                    auto* global = part.globals[i];
+                    uint64_t size = part.positions[i];
+                    part.positions[i] = global->offset + global->size;
+                    global->size += size;
+                }
+            }
+
+            entries_.resize(offset);
+            detail::parallelFor(threads, threads, [&](size_t t) {
+                auto& part = parts[t];
+                size_t n = 0;
+                forEachEntry(conjunctions, part.begin, part.end,
+                             [&](size_t, const expression_type* expr, Entry entry) {
+                                 size_t count = 1;
+                                 if (expr != nullptr) {
+                                     count = std::visit([](auto&& v) { return v.size(); }, expr->values);
+                                 }
+                                 for (size_t c = 0; c < count; ++c) {
+                                     entries_[part.positions[part.lists[n++]]++] = entry;
+                                 }
+                             });
+            });
+
+            // Only a list that got several entries of one conjunction can be out of order.
+            std::sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->size > b->size; });
+            detail::parallelFor(threads, lists.size(), [&](size_t i) {
+                auto* beg = entries_.data() + lists[i]->offset;
+                detail::sortEntries(beg, beg + lists[i]->size);
+            });
+        }
+
+        template <typename Pred>
+        void compact(Pred&& isDead)
+        {
+            std::vector<Entry> entries;
+            for (auto& i : indexs_) {
+                i.compact(entries_.data(), entries, isDead);
+            }
+            uint64_t offset = entries.size();
+            std::copy_if(entries_.data() + z_.offset, entries_.data() + z_.offset + z_.size,
+                         std::back_inserter(entries), [&](Entry e) { return !isDead(e); });
+            z_ = detail::ListSpan{ offset, entries.size() - offset };
+            entries_ = std::move(entries);
+        }
+
+        void save(detail::Writer& w) const
+        {
+            w.put(begin_);
+            w.put(end_);
+            w.put(z_.offset);
+            w.put(z_.size);
+            w.put(entries_.size());
+            w.putEntries(entries_.data(), entries_.size());
+            w.put(indexs_.size());
+            for (auto& i : indexs_) {
+                i.save(w);
+            }
+        }
+
+        // Every entry must belong to a conjunction of the shard, which retrieve maps to documents unchecked.
+        void load(detail::Reader& r, uint64_t conjunctions)
+        {
+            begin_ = r.get();
+            end_ = r.get();
+            z_ = detail::ListSpan{ r.get(), r.get() };
+            uint64_t size = r.get();
+            auto* entries = r.getEntries<Entry>(size);
+            entries_.assign(entries, entries + size);
+            detail::Reader::check(z_, size);
+            if ((begin_ > end_) || (end_ > conjunctions) ||
+                !std::all_of(entries_.begin(), entries_.end(),
+                             [this](Entry e) { return (e.id() >= begin_) && (e.id() < end_); })) {
+                throw std::runtime_error("kindex: corrupt index file");
+            }
+            indexs_.resize(r.getCount(4 * sizeof(uint64_t)));
+            for (auto& i : indexs_) {
+                i.load(r, size);
+            }
+        }
+
+        template <typename Func>
+        void forEach(Func&& f) const
+        {
+            for (uint32_t k = 0; k < indexs_.size(); ++k) {
+                indexs_[k].forEach(
+                  [&](const auto& key, const auto& value, const detail::ListSpan& span) { f(k, key, value, span); });
+            }
+        }
+
+        inline const detail::InvertedIndex<Key>& index(size_t k) const { return indexs_[k]; }
+
+    private:
+        uint64_t begin_ = 0;
+
+        uint64_t end_ = 0;
+
+        std::vector<detail::InvertedIndex<Key>> indexs_;
+
+        detail::ListSpan z_;
+
+        // Every posting list of the shard, z_ included, is a span of this arena.
+        std::vector<Entry> entries_;
+    };
+
+    // Key only needs std::hash and ==. Keys without operator< are ordered by hash, so two keys with equal hashes
+    // compare equivalent, which only costs deduplication a match and reordering some locality.
+    inline static bool keyLess(const Key& a, const Key& b)
+    {
+        if constexpr (std::totally_ordered<Key>) {
+            return a < b;
+        } else {
+            return std::hash<Key>{}(a) < std::hash<Key>{}(b);
+        }
+    }
+
+    // A conjunction with its expressions and their values sorted, so that conjunctions differing only in the order
+    // of expressions or values compare equal.
+    struct CanonicalConjunction
+    {
+        std::vector<expression_type> expressions;
+        size_t hash = 0;
+
+        CanonicalConjunction() = default;
+
+        explicit CanonicalConjunction(const conjunction_type& c)
+          : expressions(c.expressions)
+        {
+            for (auto& expr : expressions) {
+                std::visit(
+                  [](auto&& v) {
+                      std::sort(v.begin(), v.end());
+                      v.erase(std::unique(v.begin(), v.end()), v.end());
+                  },
+                  expr.values);
+            }
+            std::sort(expressions.begin(), expressions.end(), [](const expression_type& a, const expression_type& b) {
+                if (keyLess(a.key, b.key) || keyLess(b.key, a.key)) {
+                    return keyLess(a.key, b.key);
+                }
+                return std::tie(a.positive, a.values) < std::tie(b.positive, b.values);
+            });
+
+            auto combine = [this](size_t h) { hash ^= h + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2); };
+            for (auto& expr : expressions) {
+                combine(std::hash<Key>{}(expr.key));
+                combine(expr.positive);
+                combine(expr.values.index());
+                std::visit(
+                  [&](auto&& v) {
+                      for (auto& value : v) {
+                          combine(std::hash<std::remove_cv_t<std::remove_reference_t<decltype(value)>>>{}(value));
+                      }
+                  },
+                  expr.values);
+            }
+        }
+
+        inline bool operator==(const CanonicalConjunction& other) const
+        {
+            return (hash == other.hash) &&
+                   std::equal(expressions.begin(), expressions.end(), other.expressions.begin(),
+                              other.expressions.end(), [](const expression_type& a, const expression_type& b) {
+                                  return std::tie(a.key, a.positive, a.values) == std::tie(b.key, b.positive, b.values);
+                              });
+        }
+    };
+
+    struct CanonicalHash
+    {
+        inline size_t operator()(const CanonicalConjunction* c) const { return c->hash; }
+    };
+
+    struct CanonicalEqual
+    {
+        inline bool operator()(const CanonicalConjunction* a, const CanonicalConjunction* b) const { return *a == *b; }
+    };
+
+    // Ids 0 ... conjunctions - 1 plus the positive bit; the id of Entry::max(), the end of every match, stays unused.
+    inline static unsigned entryBits(uint64_t conjunctions) { return std::bit_width(conjunctions) + 1; }
+
+    // Gives every conjunction of the documents, in document order, an id in ids. Equal conjunctions share the id when
+    // deduplicating. unique receives the first conjunction of every id.
+    static void deduplicate(const std::vector<document_type>& documents, bool enabled, size_t threads,
+                            std::vector<const conjunction_type*>& unique, std::vector<uint64_t>& ids)
+    {
+        std::vector<const conjunction_type*> conjunctions;
+        for (auto& doc : documents) {
+            for (auto& conjunction : doc.conjunctions) {
+                conjunctions.push_back(&conjunction);
+            }
+        }
+
+        ids.resize(conjunctions.size());
+        if (!enabled) {
+            unique = std::move(conjunctions);
+            std::iota(ids.begin(), ids.end(), 0);
+            return;
+        }
+
+        std::vector<CanonicalConjunction> canonical(conjunctions.size());
+        size_t chunks = std::min(conjunctions.size(), threads * 16);
+        detail::parallelFor(threads, chunks, [&](size_t c) {
+            for (size_t i = conjunctions.size() * c / chunks; i < conjunctions.size() * (c + 1) / chunks; ++i) {
+                canonical[i] = CanonicalConjunction{ *conjunctions[i] };
+            }
+        });
+
+        std::unordered_map<const CanonicalConjunction*, uint64_t, CanonicalHash, CanonicalEqual> known;
+        known.reserve(conjunctions.size());
+        for (size_t i = 0; i < conjunctions.size(); ++i) {
+            auto [iter, inserted] = known.emplace(&canonical[i], unique.size());
+            if (inserted) {
+                unique.push_back(conjunctions[i]);
+            }
+            ids[i] = iter->second;
+        }
+    }
+
+    // Sorts the conjunctions by size, then by their positive expressions, keeping the order of conjunctions that
+    // compare equal, and renumbers ids accordingly.
+    static void reorder(std::vector<const conjunction_type*>& conjunctions, std::vector<uint64_t>& ids)
+    {
+        auto less = [](const expression_type* a, const expression_type* b) {
+            if (keyLess(a->key, b->key) || keyLess(b->key, a->key)) {
+                return keyLess(a->key, b->key);
+            }
+            return a->values < b->values;
+        };
+
+        std::vector<std::vector<const expression_type*>> positives(conjunctions.size());
+        for (size_t i = 0; i < conjunctions.size(); ++i) {
+            for (auto& expr : conjunctions[i]->expressions) {
+                if (expr.positive) {
+                    positives[i].push_back(&expr);
+                }
+            }
+            std::sort(positives[i].begin(), positives[i].end(), less);
+        }
+
+        std::vector<uint64_t> order(conjunctions.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) {
+            auto& x = positives[a];
+            auto& y = positives[b];
+            if (x.size() != y.size()) {
+                return x.size() < y.size();
+            }
+            return std::lexicographical_compare(x.begin(), x.end(), y.begin(), y.end(), less);
+        });
+
+        std::vector<uint64_t> rank(conjunctions.size());
+        std::vector<const conjunction_type*> sorted(conjunctions.size());
+        for (uint64_t r = 0; r < order.size(); ++r) {
+            rank[order[r]] = r;
+            sorted[r] = conjunctions[order[r]];
+        }
+        conjunctions = std::move(sorted);
+        for (auto& id : ids) {
+            id = rank[id];
+        }
+    }
+
+    void build(const std::vector<document_type>& documents, const BuildOptions& options)
+    {
+        size_t threads = std::max<size_t>(1, options.threads);
+
+        std::vector<const conjunction_type*> conjunctions;
+        std::vector<uint64_t> ids;
+        deduplicate(documents, options.deduplicate, threads, conjunctions, ids);
+        if (options.reorder) {
+            reorder(conjunctions, ids);
+        }
+
+        if (entryBits(conjunctions.size()) > Entry::bits) {
+            throw std::length_error("kindex: " + std::to_string(conjunctions.size()) + " distinct conjunctions need " +
+                                    std::to_string(entryBits(conjunctions.size())) +
+                                    " bit entries, the index uses " + std::to_string(Entry::bits));
+        }
+
+        documentCount_ = documents.size();
+        removed_.resize(documentCount_);
+
+        // Documents of every conjunction id in increasing order, a document holding a conjunction twice listed once.
+        std::vector<uint64_t> last(conjunctions.size(), documents.size());
+        auto forEachDocument = [&](auto&& f) {
+            std::fill(last.begin(), last.end(), documents.size());
+            size_t n = 0;
+            for (uint64_t i = 0; i < documents.size(); ++i) {
+                for (size_t j = 0; j < documents[i].conjunctions.size(); ++j, ++n) {
+                    if (last[ids[n]] != i) {
+                        last[ids[n]] = i;
+                        f(ids[n], i);
+                    }
+                }
+            }
+        };
+        conjunctionOffsets_.assign(conjunctions.size() + 1, 0);
+        forEachDocument([&](uint64_t id, uint64_t) { ++conjunctionOffsets_[id + 1]; });
+        std::partial_sum(conjunctionOffsets_.begin(), conjunctionOffsets_.end(), conjunctionOffsets_.begin());
+        conjunctionDocuments_.resize(conjunctionOffsets_.back());
+        std::vector<uint64_t> positions(conjunctionOffsets_.begin(), conjunctionOffsets_.end() - 1);
+        forEachDocument([&](uint64_t id, uint64_t docId) { conjunctionDocuments_[positions[id]++] = docId; });
+
+        size_t shards = std::max<size_t>(1, std::min<size_t>(options.shards, conjunctions.size()));
+        shards_.resize(shards);
+        detail::parallelFor(std::min(threads, shards), shards, [&](size_t i) {
+            shards_[i].build(conjunctions, conjunctions.size() * i / shards, conjunctions.size() * (i + 1) / shards,
+                             std::max<size_t>(1, threads / shards));
+        });
+        link();
+    }
+
+    // Builds the dictionary over the lists of every shard and partition. Run whenever their spans change.
+    void link()
+    {
+        static std::atomic<uint64_t> generations{ 0 };
+        generation_ = ++generations;
+
+        slots_.assign(1, 0);
+        for (auto& shard : shards_) {
+            slots_.push_back(slots_.back() + shard.partitions());
+        }
+
+        auto forEachList = [this](auto&& f) {
+            for (uint32_t i = 0; i < shards_.size(); ++i) {
+                shards_[i].forEach([&](uint32_t k, const auto& key, const auto& value, const detail::ListSpan& span) {
+                    f(key, value, detail::ListRef{ i, k, span });
+                });
+            }
+        };
+
+        dictionary_ = detail::InvertedIndex<Key>{};
+        forEachList([&](const auto& key, const auto& value, detail::ListRef) {
+            dictionary_.addEntry(key, &value, &value + 1, [](detail::ListSpan& refs) { ++refs.size; });
+        });
+        uint64_t offset = 0;
+        dictionary_.forEach([&](const auto&, const auto&, detail::ListSpan& refs) {
+            refs.offset = offset;
+            offset += refs.size;
+            refs.size = 0;
+        });
+        refs_.resize(offset);
+        forEachList([&](const auto& key, const auto& value, detail::ListRef ref) {
+            dictionary_.addEntry(key, &value, &value + 1,
+                                 [&](detail::ListSpan& refs) { refs_[refs.offset + refs.size++] = ref; });
+        });
+    }
+
+    // Looks up the triggered lists of every shard and partition with one dictionary search per key and value;
+    // plists[slots_[i] + k] receives the groups of partition k of shard i. A partition k > 0 left with fewer than k
+    // groups, or partition 0 without a z list, cannot match and is cleared; partition 0 otherwise ends with the z list.
+    void getPostingLists(std::vector<std::vector<PostingListGroup>>& plists, const Assignment& s) const
     {
-        s.trigger([&](const Key& key, auto beg, auto end) {
-            detail::PostingListGroup group;
-            indexs_[k].trigger(group, key, beg, end);
-            if (!group.empty()) {
-                result.push_back(std::move(group));
+        plists.resize(slots_.back());
+        for (auto& groups : plists) {
+            groups.clear();
+        }
+
+        // The key that last added a group to every slot.
+        std::vector<size_t> owners(plists.size(), 0);
+        size_t key = 0;
+        uint64_t query = (unionCacheSize_ == 0) ? 0 : detail::nextQuery();
+        s.trigger([&](const Key& k, auto beg, auto end) {
+            ++key;
+            auto addRef = [&](const detail::ListRef& ref, const Entry* base) {
+                if (ref.partition > s.size()) {
+                    return;
+                }
+                size_t slot = slots_[ref.shard] + ref.partition;
+                if (owners[slot] != key) {
+                    owners[slot] = key;
+                    plists[slot].emplace_back();
+                    KINDEX_COUNT(groups, 1);
+                }
+                plists[slot].back().add(ref.span.list(base));
+            };
+            auto add = [&](const detail::ListSpan& refs) {
+                for (auto i = refs.offset; i < refs.offset + refs.size; ++i) {
+                    addRef(refs_[i], shards_[refs_[i].shard].entries());
+                }
+            };
+
+            using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*beg)>>;
+            using T = std::conditional_t<std::is_same_v<value_type, std::string>, std::string, int64_t>;
+            if ((unionCacheSize_ > 0) && (std::distance(beg, end) > 1)) {
+                std::vector<T> values(beg, end);
+                std::sort(values.begin(), values.end());
+                values.erase(std::unique(values.begin(), values.end()), values.end());
+                auto& cache = unionCache<T>();
+                cache.resize(unionCacheSize_);
+                auto* slot = (values.size() > 1) ? cache.get(generation_, query, k, values) : nullptr;
+                if ((slot != nullptr) && !slot->merged && (slot->uses >= unionThreshold_)) {
+                    std::vector<detail::ListRef> refs;
+                    dictionary_.find(k, values.begin(), values.end(), [&](const detail::ListSpan& r) {
+                        refs.insert(refs.end(), refs_.begin() + r.offset, refs_.begin() + r.offset + r.size);
+                    });
+                    std::vector<const Entry*> bases;
+                    for (auto& shard : shards_) {
+                        bases.push_back(shard.entries());
+                    }
+                    cache.merge(*slot, refs, bases);
+                }
+                if ((slot != nullptr) && slot->merged) {
+                    for (auto& ref : slot->refs) {
+                        addRef(ref, slot->entries.data());
+                    }
+                    return;
+                }
             }
+            dictionary_.find(k, beg, end, add);
         });
 
-        if ((k == 0) && (!z_.empty())) {
-            detail::PostingListGroup z;
-            z.add(detail::PostingList{ z_.data(), z_.data() + z_.size() });
-            result.push_back(z);
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            for (size_t k = 1; k < shards_[i].partitions(); ++k) {
+                if (plists[slots_[i] + k].size() < k) {
+                    plists[slots_[i] + k].clear();
+                }
+            }
+            if (shards_[i].partitions() == 0) {
+                continue;
+            }
+            auto& zero = plists[slots_[i]];
+            if (shards_[i].z().size == 0) {
+                zero.clear();
+            } else {
+                PostingListGroup z;
+                z.add(shards_[i].z().list(shards_[i].entries()));
+                zero.push_back(z);
+                KINDEX_COUNT(groups, 1);
+            }
+        }
+    }
+
+    template <typename T>
+    static detail::UnionCache<Key, T, Entry>& unionCache()
+    {
+        static thread_local detail::UnionCache<Key, T, Entry> cache;
+        return cache;
+    }
+
+    // Calls f(size, expression, entry) for every expression of the conjunctions with ids in [begin, end), and with a
+    // null expression for the z entry of each conjunction without positive expressions.
+    template <typename Func>
+    static void forEachEntry(const std::vector<const conjunction_type*>& conjunctions, uint64_t begin, uint64_t end,
+                             Func&& f)
+    {
+        for (uint64_t conjunctionId = begin; conjunctionId < end; ++conjunctionId) {
+            auto& conjunction = *conjunctions[conjunctionId];
+            size_t size = getConjunctionSize(conjunction);
+            for (auto& expr : conjunction.expressions) {
+                f(size, &expr, Entry(conjunctionId, expr.positive));
+            }
+
+            if (size == 0) {
+                f(size, nullptr, Entry(conjunctionId, true));
+            }
         }
     }
 
-    std::vector<detail::InvertedIndex<Key>> indexs_;
+    // Matches the conjunctions of size k whose entry ids fall in [begin, end) against the triggered posting lists.
+    void retrieve(ResultSet& result, std::vector<PostingListGroup>& plists, size_t k, EntryId begin,
+                  EntryId end) const
+    {
+        // Conjunctions first seen in one document have adjacent ids, so its repeated matches mostly arrive back to
+        // back.
+        uint64_t last = documentCount_;
+        detail::match(plists, k, begin, end, [&](Entry e) {
+            KINDEX_COUNT(matches, 1);
+            auto id = static_cast<uint64_t>(e.id());
+            for (auto i = conjunctionOffsets_[id]; i < conjunctionOffsets_[id + 1]; ++i) {
+                auto docId = conjunctionDocuments_[i];
+                if ((docId != last) && !removed_.test(docId)) {
+                    result.addDocumentId(docId);
+                }
+                last = docId;
+            }
+        });
+    }
+
+    std::vector<Shard> shards_;
+
+    // Every (key, value) with lists in any shard, its span indexing the refs_ of those lists.
+    detail::InvertedIndex<Key> dictionary_;
+
+    std::vector<detail::ListRef> refs_;
+
+    // First slot of the partitions of every shard in the lookup result of getPostingLists, followed by the total.
+    std::vector<size_t> slots_{ 0 };
+
+    // Tags the slots filled from the current lists in the per-thread union caches.
+    uint64_t generation_ = 0;
+
+    size_t unionCacheSize_ = 0;
+
+    uint64_t unionThreshold_ = 2;
+
+    // Documents of conjunction id i are conjunctionDocuments_[conjunctionOffsets_[i], conjunctionOffsets_[i + 1]).
+    std::vector<uint64_t> conjunctionOffsets_;
+
+    std::vector<uint64_t> conjunctionDocuments_;
+
+    detail::Bitmap removed_;
+
+    uint64_t documentCount_ = 0;
+
+    uint64_t removedCount_ = 0;
+
+    uint64_t compactedCount_ = 0;
 
-    std::vector<detail::Entry> z_;
+    double compactionThreshold_ = 0.25;
 };
 
-} // namespace kindex
\ No newline at end of file
+} // namespace kindex
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <kindex.h>
+
+namespace kindex {
+
+struct ResultCacheMetrics
+{
+    uint64_t hits = 0;
+
+    uint64_t misses = 0;
+
+    // Entries dropped to stay within the capacity.
+    uint64_t evictions = 0;
+
+    // Times a newer index version dropped every entry.
+    uint64_t invalidations = 0;
+
+    inline double hitRate() const { return (hits + misses == 0) ? 0.0 : static_cast<double>(hits) / (hits + misses); }
+};
+
+// Caches whole query results in front of the index pinned by a SnapshotHolder::Reader, or anything else whose
+// operator* gives an index with retrieve(ResultSet&, const Assignment&) and whose version() gives the version of
+// exactly that index. Entries are keyed by the set of (key, value) pairs the assignment triggers: assignments that
+// differ only in the order of keys or values share an entry. Entries belong to one version of the index and the first
+// lookup with a newer version drops them all, so the version must change with every change of the results, removals
+// included. Lookups with an older version bypass the cache. Entries are spread over independently locked shards by
+// their fingerprint so concurrent lookups rarely contend; each shard evicts its least recently used entry beyond its
+// share of the capacity.
+template <typename Key, typename Assignment>
+class ResultCache
+{
+    using Value = std::variant<int64_t, std::string>;
+    using Pairs = std::vector<std::pair<Key, Value>>;
+
+    struct Item
+    {
+        uint64_t fingerprint;
+        Pairs pairs;
+        ResultSet result;
+    };
+
+    // Aligned to keep the mutexes of neighbouring shards off a shared cache line.
+    struct alignas(64) Shard
+    {
+        mutable std::mutex mutex;
+
+        uint64_t version = 0;
+
+        // Most recently used first.
+        std::list<Item> items;
+
+        std::unordered_map<uint64_t, typename std::list<Item>::iterator> fingerprints;
+
+        ResultCacheMetrics metrics;
+    };
+
+public:
+    explicit ResultCache(size_t capacity, size_t shards = 16)
+      : capacity_(capacity)
+      , shardCapacity_((capacity + std::max<size_t>(shards, 1) - 1) / std::max<size_t>(shards, 1))
+      , shards_(std::max<size_t>(shards, 1))
+    {
+    }
+
+    template <typename Reader>
+    void retrieve(const Reader& reader, ResultSet& result, const Assignment& s)
+    {
+        uint64_t version = reader.version();
+        auto pairs = canonical(s);
+        uint64_t fingerprint = hash(pairs);
+        Shard& shard = shards_[fingerprint % shards_.size()];
+        {
+            std::lock_guard<std::mutex> lock{ shard.mutex };
+            if (version > shard.version) {
+                if (!shard.items.empty()) {
+                    ++shard.metrics.invalidations;
+                }
+                shard.items.clear();
+                shard.fingerprints.clear();
+                shard.version = version;
+            }
+            if (version == shard.version) {
+                auto iter = shard.fingerprints.find(fingerprint);
+                if ((iter != shard.fingerprints.end()) && (iter->second->pairs == pairs)) {
+                    shard.items.splice(shard.items.begin(), shard.items, iter->second);
+                    ++shard.metrics.hits;
+                    result.merge(iter->second->result);
+                    return;
+                }
+            }
+            ++shard.metrics.misses;
+        }
+
+        ResultSet fresh;
+        (*reader).retrieve(fresh, s);
+        result.merge(fresh);
+        // Only a miss does the work of retrieve; the stored copy must not count it again on every hit.
+        result.stats_ += fresh.stats_;
+        fresh.stats_ = RetrieveStats{};
+
+        std::lock_guard<std::mutex> lock{ shard.mutex };
+        if ((version != shard.version) || (shardCapacity_ == 0)) {
+            return;
+        }
+        auto iter = shard.fingerprints.find(fingerprint);
+        if (iter != shard.fingerprints.end()) {
+            shard.items.erase(iter->second);
+        }
+        shard.items.push_front(Item{ fingerprint, std::move(pairs), std::move(fresh) });
+        shard.fingerprints[fingerprint] = shard.items.begin();
+        while (shard.items.size() > shardCapacity_) {
+            shard.fingerprints.erase(shard.items.back().fingerprint);
+            shard.items.pop_back();
+            ++shard.metrics.evictions;
+        }
+    }
+
+    inline size_t capacity() const { return capacity_; }
+
+    inline size_t shards() const { return shards_.size(); }
+
+    size_t size() const
+    {
+        size_t size = 0;
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock{ shard.mutex };
+            size += shard.items.size();
+        }
+        return size;
+    }
+
+    // Summed over the shards, each read under its own lock.
+    ResultCacheMetrics metrics() const
+    {
+        ResultCacheMetrics metrics;
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock{ shard.mutex };
+            metrics.hits += shard.metrics.hits;
+            metrics.misses += shard.metrics.misses;
+            metrics.evictions += shard.metrics.evictions;
+            metrics.invalidations += shard.metrics.invalidations;
+        }
+        return metrics;
+    }
+
+    void clear()
+    {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock{ shard.mutex };
+            shard.items.clear();
+            shard.fingerprints.clear();
+        }
+    }
+
+private:
+    // The distinct (key, value) pairs of s in sorted order.
+    static Pairs canonical(const Assignment& s)
+    {
+        Pairs pairs;
+        s.trigger([&](const Key& key, auto beg, auto end) {
+            using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*beg)>>;
+
+            for (; beg != end; ++beg) {
+                if constexpr (std::is_same_v<value_type, std::string>) {
+                    pairs.emplace_back(key, Value{ std::in_place_index<1>, *beg });
+                } else {
+                    pairs.emplace_back(key, Value{ std::in_place_index<0>, static_cast<int64_t>(*beg) });
+                }
+            }
+        });
+        std::sort(pairs.begin(), pairs.end());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+        return pairs;
+    }
+
+    static uint64_t hash(const Pairs& pairs)
+    {
+        uint64_t h = pairs.size();
+        auto combine = [&h](size_t v) { h ^= v + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2); };
+        for (auto& [key, value] : pairs) {
+            combine(std::hash<Key>{}(key));
+            combine(std::hash<Value>{}(value));
+        }
+        return h;
+    }
+
+    size_t capacity_;
+
+    // Capacity of each shard, the total rounded up to a multiple of the shard count.
+    size_t shardCapacity_;
+
+    std::vector<Shard> shards_;
+};
+
+} // namespace kindex
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <kindex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kindex {
+
+namespace detail {
+
+// A dictionary written by InvertedIndexImpl::save, searched in place.
+template <typename Key, typename T>
+class MappedIndexImpl
+{
+    template <typename V>
+    constexpr static size_t words = std::is_same_v<V, std::string> ? 2 : 1;
+
+    constexpr static size_t keyRecord = (words<Key> + 2) * sizeof(uint64_t);
+    constexpr static size_t valueRecord = (words<T> + 2) * sizeof(uint64_t);
+
+public:
+    void load(Reader& r)
+    {
+        keyCount_ = r.getCount(keyRecord);
+        valueCount_ = r.getCount(valueRecord);
+        keys_ = r.take(keyCount_ * keyRecord);
+        values_ = r.take(valueCount_ * valueRecord);
+    }
+
+    template <typename Entry, typename Iter>
+    void trigger(PostingListGroup<Entry>& group, const Key& key, Iter beg, Iter end, const Entry* base,
+                 uint64_t entries, const Reader& strings) const
+    {
+        auto k = find<Key>(strings, keys_, keyRecord, 0, keyCount_, key);
+        if (k == keyCount_) {
+            return;
+        }
+
+        const char* record = keys_ + k * keyRecord + words<Key> * sizeof(uint64_t);
+        uint64_t first = word(record, 0);
+        uint64_t last = first + word(record, 1);
+        if ((first > last) || (last > valueCount_)) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+
+        for (; beg != end; ++beg) {
+            auto v = find<T>(strings, values_, valueRecord, first, last, static_cast<const T&>(*beg));
+            if (v == last) {
+                continue;
+            }
+            record = values_ + v * valueRecord + words<T> * sizeof(uint64_t);
+            ListSpan span{ word(record, 0), word(record, 1) };
+            Reader::check(span, entries);
+            group.add(span.list(base));
+        }
+    }
+
+private:
+    inline static uint64_t word(const char* p, size_t i)
+    {
+        uint64_t w;
+        std::memcpy(&w, p + i * sizeof(uint64_t), sizeof(w));
+        return w;
+    }
+
+    // Binary search for v among the records [first, last), returning last if it is missing.
+    template <typename V>
+    static uint64_t find(const Reader& strings, const char* records, size_t size, uint64_t first, uint64_t last,
+                         const V& v)
+    {
+        uint64_t lo = first;
+        uint64_t hi = last;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            const char* record = records + mid * size;
+            bool less;
+            bool equal;
+            if constexpr (std::is_same_v<V, std::string>) {
+                auto field = strings.string(word(record, 0), word(record, 1));
+                less = field < std::string_view{ v };
+                equal = field == std::string_view{ v };
+            } else {
+                auto field = static_cast<V>(word(record, 0));
+                less = field < v;
+                equal = field == v;
+            }
+            if (equal) {
+                return mid;
+            }
+            if (less) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return last;
+    }
+
+    const char* keys_ = nullptr;
+
+    uint64_t keyCount_ = 0;
+
+    const char* values_ = nullptr;
+
+    uint64_t valueCount_ = 0;
+};
+
+template <typename Key>
+class MappedIndex
+{
+public:
+    void load(Reader& r)
+    {
+        intIndex_.load(r);
+        stringIndex_.load(r);
+    }
+
+    template <typename Entry, typename Iter>
+    void trigger(PostingListGroup<Entry>& group, const Key& key, Iter beg, Iter end, const Entry* base,
+                 uint64_t entries, const Reader& strings) const
+    {
+        using value_type = std::remove_cv_t<std::remove_reference_t<decltype(*beg)>>;
+
+        static_assert(std::is_integral_v<value_type> || std::is_same_v<value_type, std::string>, "unsupport type");
+
+        if constexpr (std::is_same_v<value_type, std::string>) {
+            stringIndex_.trigger(group, key, beg, end, base, entries, strings);
+        } else if constexpr (std::is_integral_v<value_type>) {
+            intIndex_.trigger(group, key, beg, end, base, entries, strings);
+        }
+    }
+
+private:
+    MappedIndexImpl<Key, int64_t> intIndex_;
+    MappedIndexImpl<Key, std::string> stringIndex_;
+};
+
+} // namespace detail
+
+// Serves retrieve straight out of a memory-mapped file written by Indexer::save. Only the small per-shard directory
+// is read when opening; posting lists and dictionaries are used in place, so worker processes mapping the same file
+// share one page cache copy. With verify == false neither the checksum nor the entry ids are checked and the file is
+// trusted.
+template <typename Key, typename Assignment, typename Word = uint64_t>
+class MappedIndexer
+{
+    using Entry = detail::BasicEntry<Word>;
+    using PostingListGroup = detail::PostingListGroup<Entry>;
+
+    struct Shard
+    {
+        uint64_t begin;
+        uint64_t end;
+        const Entry* entries;
+        uint64_t size;
+        detail::ListSpan z;
+        std::vector<detail::MappedIndex<Key>> indexs;
+    };
+
+public:
+    explicit MappedIndexer(const std::string& path, bool verify = true)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "kindex: open " + path);
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), "kindex: stat " + path);
+        }
+        size_ = st.st_size;
+        if (size_ < sizeof(detail::FileHeader)) {
+            ::close(fd);
+            throw std::runtime_error("kindex: truncated index file");
+        }
+
+        void* data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        int err = errno;
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::system_error(err, std::generic_category(), "kindex: mmap " + path);
+        }
+        data_ = static_cast<const char*>(data);
+
+        try {
+            parse(verify);
+        } catch (...) {
+            ::munmap(const_cast<char*>(data_), size_);
+            throw;
+        }
+    }
+
+    MappedIndexer(const MappedIndexer&) = delete;
+
+    MappedIndexer& operator=(const MappedIndexer&) = delete;
+
+    ~MappedIndexer() { ::munmap(const_cast<char*>(data_), size_); }
+
+    void retrieve(ResultSet& result, const Assignment& s) const
+    {
+        detail::StatsScope scope{ result.stats_ };
+        std::vector<PostingListGroup> plists;
+        for (auto& shard : shards_) {
+            for (int i = std::min<int>(shard.indexs.size() - 1, s.size()); i >= 0; --i) {
+                plists.clear();
+                s.trigger([&](const Key& key, auto beg, auto end) {
+                    PostingListGroup group;
+                    shard.indexs[i].trigger(group, key, beg, end, shard.entries, shard.size, reader_);
+                    if (!group.empty()) {
+                        plists.push_back(std::move(group));
+                        KINDEX_COUNT(groups, 1);
+                    }
+                });
+                if (i == 0) {
+                    PostingListGroup z;
+                    z.add(shard.z.list(shard.entries));
+                    plists.push_back(z);
+                    KINDEX_COUNT(groups, 1);
+                }
+
+                KINDEX_COUNT(partitions, 1);
+                uint64_t last = documentCount_;
+                detail::match(plists, i, 0, Entry::max().id(), [&](Entry e) {
+                    KINDEX_COUNT(matches, 1);
+                    auto id = static_cast<uint64_t>(e.id());
+                    for (auto j = conjunctionOffsets_[id]; j < conjunctionOffsets_[id + 1]; ++j) {
+                        auto docId = conjunctionDocuments_[j];
+                        if ((docId != last) && !removed(docId)) {
+                            result.addDocumentId(docId);
+                        }
+                        last = docId;
+                    }
+                });
+            }
+        }
+    }
+
+    inline uint64_t documentCount() const { return documentCount_; }
+
+    inline bool removed(uint64_t docId) const
+    {
+        return (docId / 64 < removedWords_) && (removed_[docId / 64] & (uint64_t{ 1 } << (docId % 64)));
+    }
+
+private:
+    void parse(bool verify)
+    {
+        detail::FileHeader header;
+        std::memcpy(&header, data_, sizeof(header));
+        reader_ = detail::Reader::open(header, data_ + sizeof(header), size_ - sizeof(header), verify);
+        auto& r = reader_;
+
+        if (r.get() != sizeof(Word)) {
+            throw std::runtime_error("kindex: index file was written with a different entry width");
+        }
+        documentCount_ = r.get();
+        r.get();
+        r.get();
+        removedWords_ = r.getCount(sizeof(uint64_t));
+        removed_ = reinterpret_cast<const uint64_t*>(r.take(removedWords_ * sizeof(uint64_t)));
+        uint64_t offsets = r.getCount(sizeof(uint64_t));
+        conjunctionOffsets_ = reinterpret_cast<const uint64_t*>(r.take(offsets * sizeof(uint64_t)));
+        uint64_t documents = r.getCount(sizeof(uint64_t));
+        conjunctionDocuments_ = reinterpret_cast<const uint64_t*>(r.take(documents * sizeof(uint64_t)));
+        if ((offsets == 0) || (conjunctionOffsets_[0] != 0) || (conjunctionOffsets_[offsets - 1] != documents) ||
+            !std::is_sorted(conjunctionOffsets_, conjunctionOffsets_ + offsets)) {
+            throw std::runtime_error("kindex: corrupt index file");
+        }
+        conjunctions_ = offsets - 1;
+
+        shards_.resize(r.getCount(6 * sizeof(uint64_t)));
+        for (auto& shard : shards_) {
+            shard.begin = r.get();
+            shard.end = r.get();
+            shard.z = detail::ListSpan{ r.get(), r.get() };
+            shard.size = r.get();
+            shard.entries = r.getEntries<Entry>(shard.size);
+            detail::Reader::check(shard.z, shard.size);
+            if ((shard.begin > shard.end) || (shard.end > conjunctions_)) {
+                throw std::runtime_error("kindex: corrupt index file");
+            }
+            // retrieve maps entry ids to documents unchecked; a trusted file skips the scan like the checksum.
+            if (verify && !std::all_of(shard.entries, shard.entries + shard.size, [&](Entry e) {
+                    return (e.id() >= shard.begin) && (e.id() < shard.end);
+                })) {
+                throw std::runtime_error("kindex: corrupt index file");
+            }
+            shard.indexs.resize(r.getCount(4 * sizeof(uint64_t)));
+            for (auto& i : shard.indexs) {
+                i.load(r);
+            }
+        }
+    }
+
+    const char* data_ = nullptr;
+
+    size_t size_ = 0;
+
+    detail::Reader reader_{ nullptr, 0, nullptr, 0 };
+
+    uint64_t documentCount_ = 0;
+
+    // Documents of conjunction id i are conjunctionDocuments_[conjunctionOffsets_[i], conjunctionOffsets_[i + 1]).
+    const uint64_t* conjunctionOffsets_ = nullptr;
+
+    const uint64_t* conjunctionDocuments_ = nullptr;
+
+    uint64_t conjunctions_ = 0;
+
+    const uint64_t* removed_ = nullptr;
+
+    uint64_t removedWords_ = 0;
+
+    std::vector<Shard> shards_;
+};
+
+} // namespace kindex
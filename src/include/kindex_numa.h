@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#    include <pthread.h>
+#    include <sched.h>
+#endif
+
+namespace kindex {
+
+// The cpus of every NUMA node.
+class NumaTopology
+{
+public:
+    explicit NumaTopology(std::vector<std::vector<int>> cpus)
+      : cpus_(std::move(cpus))
+    {
+        if (cpus_.empty()) {
+            cpus_.emplace_back();
+        }
+        for (size_t node = 0; node < cpus_.size(); ++node) {
+            for (int cpu : cpus_[node]) {
+                if (nodes_.size() <= static_cast<size_t>(cpu)) {
+                    nodes_.resize(cpu + 1, 0);
+                }
+                nodes_[cpu] = node;
+            }
+        }
+    }
+
+    // Reads the topology from sysfs, falling back to a single node without cpu pinning.
+    static NumaTopology detect()
+    {
+        std::vector<std::vector<int>> cpus;
+        for (size_t node = 0;; ++node) {
+            std::ifstream in{ "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist" };
+            std::string list;
+            if (!std::getline(in, list)) {
+                break;
+            }
+            cpus.push_back(parseCpuList(list));
+        }
+        return NumaTopology{ std::move(cpus) };
+    }
+
+    // Splits the online cpus into `nodes` contiguous groups, to exercise replication on a single node machine.
+    static NumaTopology simulate(size_t nodes)
+    {
+        std::vector<int> online;
+        for (auto& node : detect().cpus_) {
+            online.insert(online.end(), node.begin(), node.end());
+        }
+        std::sort(online.begin(), online.end());
+
+        nodes = std::max<size_t>(1, nodes);
+        std::vector<std::vector<int>> cpus(nodes);
+        for (size_t i = 0; i < online.size(); ++i) {
+            cpus[i * nodes / online.size()].push_back(online[i]);
+        }
+        return NumaTopology{ std::move(cpus) };
+    }
+
+    inline size_t nodes() const { return cpus_.size(); }
+
+    inline const std::vector<int>& cpus(size_t node) const { return cpus_[node]; }
+
+    inline size_t nodeOf(int cpu) const
+    {
+        return ((cpu >= 0) && (static_cast<size_t>(cpu) < nodes_.size())) ? nodes_[cpu] : 0;
+    }
+
+    // Node of the cpu the calling thread currently runs on.
+    inline size_t currentNode() const
+    {
+#if defined(__linux__)
+        return nodeOf(sched_getcpu());
+#else
+        return 0;
+#endif
+    }
+
+    // Restricts a thread to the cpus of node. Does nothing if the node has no known cpus.
+    bool pin(std::thread& thread, size_t node) const
+    {
+#if defined(__linux__)
+        if (cpus_[node].empty()) {
+            return false;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus_[node]) {
+            CPU_SET(cpu, &set);
+        }
+        return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+
+private:
+    static std::vector<int> parseCpuList(const std::string& list)
+    {
+        std::vector<int> cpus;
+        std::stringstream ss{ list };
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty()) {
+                continue;
+            }
+            auto dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    std::vector<std::vector<int>> cpus_;
+
+    std::vector<size_t> nodes_;
+};
+
+// One copy of an index per NUMA node. Each copy is made by a thread pinned to its node, so with the kernel's default
+// first-touch policy the arenas and dictionaries of the copy are allocated on that node. Readers call local() to get
+// the replica of the node they run on.
+template <typename T>
+class Replicated
+{
+public:
+    Replicated(const T& source, NumaTopology topology)
+      : topology_(std::move(topology))
+      , replicas_(topology_.nodes())
+    {
+        for (size_t node = 0; node < replicas_.size(); ++node) {
+            std::atomic<bool> pinned{ false };
+            std::thread t{ [&, node]() {
+                // Wait for the affinity to be applied before touching memory.
+                while (!pinned.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                replicas_[node] = std::make_unique<T>(source);
+            } };
+            topology_.pin(t, node);
+            pinned.store(true, std::memory_order_release);
+            t.join();
+        }
+    }
+
+    inline const T& local() const { return *replicas_[topology_.currentNode()]; }
+
+    inline const T& replica(size_t node) const { return *replicas_[node]; }
+
+    inline size_t replicas() const { return replicas_.size(); }
+
+    inline const NumaTopology& topology() const { return topology_; }
+
+private:
+    NumaTopology topology_;
+
+    std::vector<std::unique_ptr<T>> replicas_;
+};
+
+} // namespace kindex
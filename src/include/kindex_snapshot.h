@@ -0,0 +1,213 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kindex {
+
+// Holds the current version of an immutable index. Readers pin the published snapshot without touching a shared
+// reference count or lock: each reader announces the global epoch in its own cache line, and a snapshot replaced by
+// publish() is only deleted once every announced epoch has moved past the epoch it was retired in. Slots is the
+// number of reader slots per block; when all are taken read() adds a block instead of waiting, so any number of
+// threads can read at once.
+template <typename T, size_t Slots = 128>
+class SnapshotHolder
+{
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch{ 0 };
+    };
+
+    struct Block
+    {
+        Slot slots[Slots];
+        Block* next = nullptr;
+    };
+
+    // A snapshot is published together with its version, so a reader always sees the pair publish() created.
+    struct Published
+    {
+        std::unique_ptr<const T> snapshot;
+        uint64_t version;
+    };
+
+    struct Retired
+    {
+        const Published* published;
+        uint64_t epoch;
+    };
+
+public:
+    class Reader
+    {
+    public:
+        Reader(const Reader&) = delete;
+
+        Reader& operator=(const Reader&) = delete;
+
+        ~Reader() { slot_->epoch.store(0, std::memory_order_release); }
+
+        inline const T* get() const { return snapshot_; }
+
+        inline const T* operator->() const { return snapshot_; }
+
+        inline const T& operator*() const { return *snapshot_; }
+
+        inline explicit operator bool() const { return snapshot_ != nullptr; }
+
+        // The version publish() returned for this snapshot, 0 before the first publish.
+        inline uint64_t version() const { return version_; }
+
+    private:
+        friend class SnapshotHolder;
+
+        Reader(Slot* slot, const Published* published)
+          : slot_(slot)
+          , snapshot_((published == nullptr) ? nullptr : published->snapshot.get())
+          , version_((published == nullptr) ? 0 : published->version)
+        {
+        }
+
+        Slot* slot_;
+
+        const T* snapshot_;
+
+        uint64_t version_;
+    };
+
+    SnapshotHolder() = default;
+
+    explicit SnapshotHolder(std::unique_ptr<T> snapshot) { publish(std::move(snapshot)); }
+
+    SnapshotHolder(const SnapshotHolder&) = delete;
+
+    SnapshotHolder& operator=(const SnapshotHolder&) = delete;
+
+    // Must not be destroyed while a Reader is alive.
+    ~SnapshotHolder()
+    {
+        delete current_.load();
+        for (auto& r : retired_) {
+            delete r.published;
+        }
+        for (Block* block = blocks_.load(); block != &first_;) {
+            Block* next = block->next;
+            delete block;
+            block = next;
+        }
+    }
+
+    Reader read() const
+    {
+        static thread_local size_t hint = std::hash<std::thread::id>{}(std::this_thread::get_id());
+
+        uint64_t epoch = epoch_.load();
+        Block* head = blocks_.load();
+        for (Block* block = head; block != nullptr; block = block->next) {
+            for (size_t i = 0; i < Slots; ++i) {
+                auto& slot = block->slots[(hint + i) % Slots];
+                uint64_t expected = 0;
+                if (slot.epoch.compare_exchange_strong(expected, epoch)) {
+                    hint = (hint + i) % Slots;
+                    return Reader{ &slot, current_.load() };
+                }
+            }
+        }
+
+        // Every slot is taken. The new block is announced before it is linked, so reclaim sees the reader as soon
+        // as it can see the block.
+        auto* block = new Block;
+        block->slots[0].epoch.store(epoch);
+        block->next = head;
+        while (!blocks_.compare_exchange_weak(block->next, block)) {
+        }
+        return Reader{ &block->slots[0], current_.load() };
+    }
+
+    // Atomically replaces the current snapshot. The previous one is reclaimed once no reader can still observe it.
+    uint64_t publish(std::unique_ptr<T> snapshot)
+    {
+        std::lock_guard<std::mutex> lock{ writerMutex_ };
+
+        uint64_t version = ++version_;
+        const Published* old = current_.exchange(new Published{ std::move(snapshot), version });
+        uint64_t epoch = epoch_.fetch_add(1) + 1;
+        if (old != nullptr) {
+            retired_.push_back(Retired{ old, epoch });
+        }
+        reclaim();
+
+        return version;
+    }
+
+    // Blocks until every retired snapshot has been reclaimed.
+    void synchronize()
+    {
+        std::lock_guard<std::mutex> lock{ writerMutex_ };
+
+        while (!retired_.empty()) {
+            reclaim();
+            if (!retired_.empty()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // The version of the current snapshot; use Reader::version() for the version of a pinned one.
+    inline uint64_t version() const
+    {
+        const Published* published = current_.load();
+        return (published == nullptr) ? 0 : published->version;
+    }
+
+    inline size_t retired() const
+    {
+        std::lock_guard<std::mutex> lock{ writerMutex_ };
+        return retired_.size();
+    }
+
+private:
+    void reclaim()
+    {
+        uint64_t minEpoch = std::numeric_limits<uint64_t>::max();
+        for (Block* block = blocks_.load(); block != nullptr; block = block->next) {
+            for (auto& slot : block->slots) {
+                uint64_t epoch = slot.epoch.load();
+                if ((epoch != 0) && (epoch < minEpoch)) {
+                    minEpoch = epoch;
+                }
+            }
+        }
+
+        std::erase_if(retired_, [minEpoch](const Retired& r) {
+            if (r.epoch > minEpoch) {
+                return false;
+            }
+            delete r.published;
+            return true;
+        });
+    }
+
+    std::atomic<const Published*> current_{ nullptr };
+
+    std::atomic<uint64_t> epoch_{ 1 };
+
+    // Last version handed out by publish(), guarded by writerMutex_.
+    uint64_t version_ = 0;
+
+    mutable Block first_;
+
+    mutable std::atomic<Block*> blocks_{ &first_ };
+
+    mutable std::mutex writerMutex_;
+
+    std::vector<Retired> retired_;
+};
+
+} // namespace kindex
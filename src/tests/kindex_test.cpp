@@ -0,0 +1,953 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <latch>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include <kindex.h>
+#include <kindex_cache.h>
+#include <kindex_mmap.h>
+#include <kindex_numa.h>
+#include <kindex_snapshot.h>
+
+// Differential checks of the index against a brute-force evaluation of the documents, and of its kernels against
+// their plain counterparts, over random inputs. Also checks SnapshotHolder reclaiming what it publishes, ResultCache
+// across snapshot versions, the placement of NUMA replicas, the shape Indexer::stats() reports, and the
+// RetrieveStats counters, which are only counted when built with KINDEX_ENABLE_STATS=1.
+
+using namespace kindex;
+
+// A key with std::hash and == but no ordering.
+struct NamedKey
+{
+    std::string name;
+
+    bool operator==(const NamedKey&) const = default;
+};
+
+template <>
+struct std::hash<NamedKey>
+{
+    size_t operator()(const NamedKey& key) const { return std::hash<std::string>{}(key.name); }
+};
+
+namespace {
+
+std::mt19937_64 rng{ 12345 };
+
+int failures = 0;
+
+size_t random(size_t n)
+{
+    return rng() % n;
+}
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok) {
+        ++failures;
+        std::printf("FAILED: %s\n", what.c_str());
+    }
+}
+
+class Assignment
+{
+public:
+    template <typename TriggerFunc>
+    void trigger(TriggerFunc&& t) const
+    {
+        for (auto& [key, values] : ints) {
+            t(key, values.begin(), values.end());
+        }
+        for (auto& [key, values] : strings) {
+            t(key, values.begin(), values.end());
+        }
+    }
+
+    size_t size() const { return ints.size() + strings.size(); }
+
+    std::map<std::string, std::vector<int64_t>> ints;
+
+    std::map<std::string, std::vector<std::string>> strings;
+};
+
+class ThreadExecutor
+{
+public:
+    ~ThreadExecutor()
+    {
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    void execute(std::function<void()> f) { threads_.emplace_back(std::move(f)); }
+
+private:
+    std::vector<std::thread> threads_;
+};
+
+// Runs the first `accepted` tasks and throws on the next one.
+class FailingExecutor
+{
+public:
+    explicit FailingExecutor(size_t accepted)
+      : accepted_(accepted)
+    {
+    }
+
+    void execute(std::function<void()> f)
+    {
+        if (accepted_ == 0) {
+            throw std::runtime_error("executor refused a task");
+        }
+        --accepted_;
+        threads_.execute(std::move(f));
+    }
+
+private:
+    size_t accepted_;
+
+    ThreadExecutor threads_;
+};
+
+const std::vector<std::string> intKeys = { "a", "b", "c", "d", "e", "f" };
+const std::vector<std::string> stringKeys = { "s", "t", "u" };
+
+Conjunction<std::string> randomConjunction()
+{
+    Conjunction<std::string> c;
+    auto keys = intKeys;
+    std::shuffle(keys.begin(), keys.end(), rng);
+    for (size_t i = random(4); i-- > 0;) {
+        Expression<std::string> expr;
+        expr.key = keys[i];
+        expr.positive = random(3) != 0;
+        std::vector<int64_t> values;
+        for (size_t v = 1 + random(3); v-- > 0;) {
+            values.push_back(random(5));
+        }
+        expr.values = values;
+        c.expressions.push_back(expr);
+    }
+
+    keys = stringKeys;
+    std::shuffle(keys.begin(), keys.end(), rng);
+    for (size_t i = random(2); i-- > 0;) {
+        Expression<std::string> expr;
+        expr.key = keys[i];
+        expr.positive = random(3) != 0;
+        std::vector<std::string> values;
+        for (size_t v = 1 + random(2); v-- > 0;) {
+            values.push_back(std::string(1, 'x' + random(3)));
+        }
+        expr.values = values;
+        c.expressions.push_back(expr);
+    }
+    return c;
+}
+
+// Documents often repeat an earlier conjunction, reordered, so deduplication has work to do.
+std::vector<Document<std::string>> randomDocuments()
+{
+    std::vector<Conjunction<std::string>> seen;
+    std::vector<Document<std::string>> docs(random(300));
+    for (auto& doc : docs) {
+        for (size_t i = random(4); i-- > 0;) {
+            if (seen.empty() || random(2)) {
+                seen.push_back(randomConjunction());
+                doc.conjunctions.push_back(seen.back());
+                continue;
+            }
+            auto c = seen[random(seen.size())];
+            std::shuffle(c.expressions.begin(), c.expressions.end(), rng);
+            for (auto& expr : c.expressions) {
+                std::visit([](auto& v) { std::shuffle(v.begin(), v.end(), rng); }, expr.values);
+            }
+            doc.conjunctions.push_back(c);
+        }
+    }
+    return docs;
+}
+
+Assignment randomAssignment()
+{
+    Assignment s;
+    for (auto& key : intKeys) {
+        for (size_t i = random(2) ? 1 + random(4) : 0; i-- > 0;) {
+            s.ints[key].push_back(random(5));
+        }
+    }
+    for (auto& key : stringKeys) {
+        for (size_t i = random(2) ? 1 + random(2) : 0; i-- > 0;) {
+            s.strings[key].push_back(std::string(1, 'x' + random(3)));
+        }
+    }
+    return s;
+}
+
+const std::map<std::string, std::vector<int64_t>>& assigned(const Assignment& s, const std::vector<int64_t>&)
+{
+    return s.ints;
+}
+
+const std::map<std::string, std::vector<std::string>>& assigned(const Assignment& s, const std::vector<std::string>&)
+{
+    return s.strings;
+}
+
+bool holds(const Expression<std::string>& expr, const Assignment& s)
+{
+    bool hit = std::visit(
+      [&](auto&& values) {
+          auto& map = assigned(s, values);
+          auto iter = map.find(expr.key);
+          return (iter != map.end()) && std::any_of(values.begin(), values.end(), [&](auto& v) {
+                     return std::find(iter->second.begin(), iter->second.end(), v) != iter->second.end();
+                 });
+      },
+      expr.values);
+    return hit == expr.positive;
+}
+
+std::set<uint64_t> bruteForce(const std::vector<Document<std::string>>& docs, const Assignment& s,
+                              const std::set<uint64_t>& removed)
+{
+    std::set<uint64_t> result;
+    for (uint64_t docId = 0; docId < docs.size(); ++docId) {
+        if (removed.count(docId)) {
+            continue;
+        }
+        for (auto& c : docs[docId].conjunctions) {
+            if (std::all_of(c.expressions.begin(), c.expressions.end(),
+                            [&](auto& expr) { return holds(expr, s); })) {
+                result.insert(docId);
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+std::set<uint64_t> documents(const ResultSet& result)
+{
+    return std::set<uint64_t>(result.result_.begin(), result.result_.end());
+}
+
+template <typename Word>
+void testSort()
+{
+    using Entry = detail::BasicEntry<Word>;
+
+    for (int i = 0; i < 200; ++i) {
+        std::vector<Entry> entries(random(2000));
+        // Few conjunctions leave the high bytes equal, which the sort skips.
+        Word range = random(2) ? 64 : std::numeric_limits<Word>::max() / 2;
+        for (auto& e : entries) {
+            e = Entry(rng() % range, random(2));
+        }
+        auto expected = entries;
+        std::sort(expected.begin(), expected.end());
+        detail::sortEntries(entries.data(), entries.data() + entries.size());
+        check(entries == expected, "sortEntries");
+    }
+}
+
+template <typename Word>
+void testScan()
+{
+    using Entry = detail::BasicEntry<Word>;
+
+    std::vector<std::pair<const char*, detail::ScanFunc<Entry>>> kernels = { { "scalar", detail::scanScalar<Entry> },
+                                                                             { "selected", detail::scan<Entry> } };
+#if KINDEX_X86_SIMD
+    if (__builtin_cpu_supports("sse4.2")) {
+        kernels.emplace_back("sse", detail::scanSse<Entry>);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.emplace_back("avx2", detail::scanAvx2<Entry>);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.emplace_back("avx512", detail::scanAvx512<Entry>);
+    }
+#endif
+
+    for (int i = 0; i < 500; ++i) {
+        std::vector<Entry> entries(random(100));
+        // Ids near the top of the range check the unsigned compares.
+        Word base = random(2) ? 0 : std::numeric_limits<Word>::max() / 2 - 1000;
+        for (auto& e : entries) {
+            e = Entry(base + random(500), random(2));
+        }
+        std::sort(entries.begin(), entries.end());
+        Word value = Entry(base + random(520), false).value();
+        auto expected = std::lower_bound(entries.begin(), entries.end(), value,
+                                         [](Entry e, Word v) { return e.value() < v; }) -
+                        entries.begin();
+        for (auto& [name, kernel] : kernels) {
+            auto* begin = entries.data();
+            check(kernel(begin, begin + entries.size(), value) - begin == expected, std::string{ "scan " } + name);
+        }
+    }
+}
+
+// match against counting, per id, the groups holding it and whether any holds a negative entry for it. For k == 0
+// the last group is a z list of positive entries, matching unless excluded.
+void testMatch()
+{
+    using Entry = detail::BasicEntry<uint64_t>;
+
+    // k runs past detail::maxFixedK into the generic loop.
+    for (int i = 0; i < 5000; ++i) {
+        size_t k = random(11);
+        size_t n = 1 + random(12);
+        uint64_t range = 1 + random(60);
+        std::vector<std::vector<std::vector<Entry>>> data(n + 1);
+        std::map<uint64_t, std::pair<size_t, bool>> ids;
+        for (size_t g = 0; g < n; ++g) {
+            data[g].resize(1 + random(3));
+            std::set<uint64_t> held;
+            for (auto& list : data[g]) {
+                for (size_t e = random(30); e-- > 0;) {
+                    uint64_t id = random(range);
+                    bool positive = random(5) != 0;
+                    list.emplace_back(id, positive);
+                    held.insert(id);
+                    ids[id].second |= !positive;
+                }
+                std::sort(list.begin(), list.end());
+            }
+            for (auto id : held) {
+                ++ids[id].first;
+            }
+        }
+        std::set<uint64_t> z;
+        if (k == 0) {
+            data[n].resize(1);
+            for (uint64_t id = 0; id < range; ++id) {
+                if (random(2)) {
+                    data[n][0].emplace_back(id, true);
+                    z.insert(id);
+                }
+            }
+        }
+
+        uint64_t begin = random(3) ? 0 : random(range);
+        uint64_t end = random(3) ? Entry::max().id() : begin + random(range);
+        std::set<uint64_t> expected;
+        for (uint64_t id = begin; (id < end) && (id < range); ++id) {
+            auto iter = ids.find(id);
+            bool negative = (iter != ids.end()) && iter->second.second;
+            if (k == 0) {
+                if (z.count(id) && !negative) {
+                    expected.insert(id);
+                }
+            } else if ((iter != ids.end()) && (iter->second.first >= k) && !negative) {
+                expected.insert(id);
+            }
+        }
+
+        std::vector<detail::PostingListGroup<Entry>> groups(data.size());
+        for (size_t g = 0; g < data.size(); ++g) {
+            for (auto& list : data[g]) {
+                groups[g].add(detail::PostingList<Entry>(list.data(), list.data() + list.size()));
+            }
+        }
+        std::erase_if(groups, [](auto& g) { return g.empty(); });
+        if ((k == 0) && z.empty()) {
+            continue;
+        }
+        std::set<uint64_t> matched;
+        detail::match(groups, k, begin, end, [&](Entry e) { matched.insert(e.id()); });
+        check(matched == expected, "match k = " + std::to_string(k));
+    }
+}
+
+// Whether both Indexer::load and a verifying MappedIndexer reject the file.
+template <typename Word>
+bool rejected(const std::string& bytes)
+{
+    int rejections = 0;
+    try {
+        std::stringstream in{ bytes };
+        Indexer<std::string, Assignment, Word>::load(in);
+    } catch (const std::runtime_error&) {
+        ++rejections;
+    }
+    {
+        std::ofstream out{ "kindex_test_corrupt.bin", std::ios::binary };
+        out << bytes;
+    }
+    try {
+        MappedIndexer<std::string, Assignment, Word> mapped{ "kindex_test_corrupt.bin" };
+    } catch (const std::runtime_error&) {
+        ++rejections;
+    }
+    std::remove("kindex_test_corrupt.bin");
+    return rejections == 2;
+}
+
+// Points the first entry of the first shard at the conjunction just past the shard and recomputes the checksum, so
+// that only the entry id checks can reject the file. Returns false if that shard has no entries.
+template <typename Word>
+bool corruptEntryId(std::string& bytes)
+{
+    detail::FileHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    char* body = bytes.data() + sizeof(header);
+    auto word = [&](size_t i) {
+        uint64_t w;
+        std::memcpy(&w, body + i * sizeof(w), sizeof(w));
+        return w;
+    };
+
+    // Entry width and document counts, then the removed bitmap and the two conjunction tables as counted arrays.
+    size_t i = 4;
+    for (int array = 0; array < 3; ++array) {
+        i += 1 + word(i);
+    }
+    // The shard count, then begin, end, z and the entry count of the first shard.
+    if ((word(i) == 0) || (word(i + 5) == 0)) {
+        return false;
+    }
+    detail::BasicEntry<Word> entry{ static_cast<Word>(word(i + 2)), true };
+    std::memcpy(body + (i + 6) * sizeof(uint64_t), &entry, sizeof(entry));
+
+    header.checksum =
+      detail::checksum(body + header.mainSize, header.stringSize, detail::checksum(body, header.mainSize));
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    return true;
+}
+
+template <typename Word>
+void testIndexer(int iterations)
+{
+    using Indexer = kindex::Indexer<std::string, Assignment, Word>;
+
+    int refused = 0;
+    for (int i = 0; i < iterations; ++i) {
+        auto docs = randomDocuments();
+        BuildOptions options;
+        options.threads = 1 + random(4);
+        options.shards = 1 + random(4);
+        options.deduplicate = random(4) != 0;
+        options.reorder = random(2);
+        auto indexer = Indexer::create(docs, options);
+        size_t unionCache = random(2) ? 0 : 1 + random(8);
+        uint64_t unionThreshold = 1 + random(3);
+        indexer.setUnionCache(unionCache, unionThreshold);
+
+        // Repeated assignments fill the union cache.
+        std::vector<Assignment> hot(3);
+        for (auto& s : hot) {
+            s = randomAssignment();
+        }
+        auto assignment = [&]() { return random(2) ? hot[random(hot.size())] : randomAssignment(); };
+
+        std::set<uint64_t> removed;
+        for (int q = 0; q < 20; ++q) {
+            auto s = assignment();
+            auto expected = bruteForce(docs, s, removed);
+            ResultSet result;
+            indexer.retrieve(result, s);
+            check(documents(result) == expected, "retrieve");
+
+            ThreadExecutor executor;
+            ResultSet parallel;
+            indexer.retrieve(parallel, s, executor, random(5));
+            check(documents(parallel) == expected, "retrieve with executor");
+
+            // The tasks already scheduled finish before the exception reaches the caller.
+            FailingExecutor failing{ random(3) };
+            ResultSet partial;
+            try {
+                indexer.retrieve(partial, s, failing, 1 + random(4));
+                check(documents(partial) == expected, "retrieve with failing executor");
+            } catch (const std::runtime_error&) {
+                ++refused;
+            }
+        }
+
+        indexer.setCompactionThreshold(random(2) ? 0.1 : 10.0);
+        for (size_t r = docs.size() / 3; r-- > 0;) {
+            uint64_t docId = random(docs.size() + 1);
+            bool expected = (docId < docs.size()) && !removed.count(docId);
+            check(indexer.remove(docId) == expected, "remove");
+            removed.insert(docId);
+        }
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int q = 0; q < 10; ++q) {
+                auto s = assignment();
+                ResultSet result;
+                indexer.retrieve(result, s);
+                check(documents(result) == bruteForce(docs, s, removed), pass ? "retrieve after compact" : "remove");
+            }
+            indexer.compact();
+        }
+
+        std::stringstream saved;
+        indexer.save(saved);
+        auto loaded = Indexer::load(saved);
+        loaded.setUnionCache(unionCache, unionThreshold);
+        {
+            std::ofstream out{ "kindex_test.bin", std::ios::binary };
+            out << saved.str();
+        }
+        MappedIndexer<std::string, Assignment, Word> mapped{ "kindex_test.bin", random(2) != 0 };
+        for (int q = 0; q < 10; ++q) {
+            auto s = assignment();
+            auto expected = bruteForce(docs, s, removed);
+            ResultSet fromLoaded;
+            loaded.retrieve(fromLoaded, s);
+            check(documents(fromLoaded) == expected, "load");
+            ResultSet fromMapped;
+            mapped.retrieve(fromMapped, s);
+            check(documents(fromMapped) == expected, "MappedIndexer");
+        }
+
+        auto bytes = saved.str();
+        bytes[random(bytes.size())] ^= 1 + random(255);
+        check(rejected<Word>(bytes), "load of a corrupt file");
+        bytes = saved.str();
+        if (corruptEntryId<Word>(bytes)) {
+            check(rejected<Word>(bytes), "load of an out of range entry id");
+        }
+    }
+    std::remove("kindex_test.bin");
+    check((iterations == 0) || (refused > 0), "executor exceptions");
+}
+
+// Forwards an assignment with its keys as NamedKey.
+class NamedAssignment
+{
+public:
+    explicit NamedAssignment(const Assignment& s)
+      : s_(s)
+    {
+    }
+
+    template <typename TriggerFunc>
+    void trigger(TriggerFunc&& t) const
+    {
+        s_.trigger([&](const std::string& key, auto beg, auto end) { t(NamedKey{ key }, beg, end); });
+    }
+
+    size_t size() const { return s_.size(); }
+
+private:
+    const Assignment& s_;
+};
+
+void testUnorderedKey()
+{
+    using Indexer = kindex::Indexer<NamedKey, NamedAssignment>;
+
+    auto docs = randomDocuments();
+    std::vector<Document<NamedKey>> named(docs.size());
+    for (size_t i = 0; i < docs.size(); ++i) {
+        for (auto& c : docs[i].conjunctions) {
+            auto& conjunction = named[i].conjunctions.emplace_back();
+            for (auto& expr : c.expressions) {
+                conjunction.expressions.push_back(
+                  Expression<NamedKey>{ NamedKey{ expr.key }, expr.values, expr.positive });
+            }
+        }
+    }
+    BuildOptions options;
+    options.deduplicate = true;
+    options.reorder = true;
+    auto indexer = Indexer::create(named, options);
+    for (int q = 0; q < 10; ++q) {
+        auto s = randomAssignment();
+        ResultSet result;
+        indexer.retrieve(result, NamedAssignment{ s });
+        check(documents(result) == bruteForce(docs, s, {}), "key without ordering");
+    }
+}
+
+// Without deduplication 16 bit entries hold 32767 conjunctions; the id of Entry::max() ends every match and stays
+// unused.
+void testEntryWidth()
+{
+    using Indexer = kindex::Indexer<std::string, Assignment, uint16_t>;
+
+    auto documents = [](size_t n) {
+        std::vector<Document<std::string>> docs(n);
+        for (size_t i = 0; i < n; ++i) {
+            Expression<std::string> expr;
+            expr.key = "a";
+            expr.values = std::vector<int64_t>{ static_cast<int64_t>(i % 5) };
+            expr.positive = true;
+            docs[i].conjunctions.resize(1);
+            docs[i].conjunctions[0].expressions.push_back(expr);
+        }
+        return docs;
+    };
+
+    auto docs = documents(32767);
+    check(Indexer::entryBits(docs) == 16, "entryBits");
+    BuildOptions options;
+    options.deduplicate = false;
+    auto indexer = Indexer::create(docs, options);
+    Assignment s;
+    s.ints["a"] = { 32766 % 5 };
+    ResultSet result;
+    indexer.retrieve(result, s);
+    check((result.result_.size() == 32767 / 5 + 1) && result.result_.count(32766), "16 bit entries");
+
+    bool threw = false;
+    try {
+        Indexer::create(documents(32768), options);
+    } catch (const std::length_error&) {
+        threw = true;
+    }
+    check(threw, "create beyond the entry width");
+}
+
+void testNuma()
+{
+    NumaTopology topology{ { { 0, 2 }, { 1, 3 } } };
+    check((topology.nodes() == 2) && (topology.nodeOf(2) == 0) && (topology.nodeOf(3) == 1), "NumaTopology");
+    check((topology.nodeOf(-1) == 0) && (topology.nodeOf(64) == 0), "NumaTopology unknown cpu");
+
+    std::vector<int> online;
+    auto detected = NumaTopology::detect();
+    for (size_t node = 0; node < detected.nodes(); ++node) {
+        online.insert(online.end(), detected.cpus(node).begin(), detected.cpus(node).end());
+    }
+    std::sort(online.begin(), online.end());
+    for (size_t nodes = 0; nodes < 5; ++nodes) {
+        auto simulated = NumaTopology::simulate(nodes);
+        std::vector<int> cpus;
+        for (size_t node = 0; node < simulated.nodes(); ++node) {
+            for (int cpu : simulated.cpus(node)) {
+                check(simulated.nodeOf(cpu) == node, "simulate nodeOf");
+                cpus.push_back(cpu);
+            }
+        }
+        check(simulated.nodes() == std::max<size_t>(nodes, 1), "simulate nodes");
+        check(cpus == online, "simulate splits the online cpus in order");
+    }
+
+    using Indexer = kindex::Indexer<std::string, Assignment>;
+    auto docs = randomDocuments();
+    Replicated<Indexer> replicated{ Indexer::create(docs), NumaTopology::simulate(3) };
+    check((replicated.replicas() == 3) && (&replicated.replica(0) != &replicated.replica(1)), "Replicated");
+    for (int q = 0; q < 10; ++q) {
+        auto s = randomAssignment();
+        auto expected = bruteForce(docs, s, {});
+        for (size_t node = 0; node < replicated.replicas(); ++node) {
+            ResultSet result;
+            replicated.replica(node).retrieve(result, s);
+            check(documents(result) == expected, "Replicated retrieve");
+        }
+        ResultSet result;
+        replicated.local().retrieve(result, s);
+        check(documents(result) == expected, "Replicated local");
+    }
+}
+
+struct Counted
+{
+    explicit Counted(int v)
+      : value(v)
+    {
+        ++alive;
+    }
+
+    ~Counted() { --alive; }
+
+    int value;
+
+    static inline std::atomic<int> alive{ 0 };
+};
+
+void testSnapshot()
+{
+    SnapshotHolder<Counted, 4> holder{ std::make_unique<Counted>(0) };
+    {
+        auto reader = holder.read();
+        check(holder.publish(std::make_unique<Counted>(1)) == 2, "publish version");
+        check((reader->value == 0) && (holder.retired() == 1), "snapshot kept while read");
+        check((reader.version() == 1) && (holder.version() == 2), "version of a pinned snapshot");
+        auto current = holder.read();
+        check((current->value == 1) && (current.version() == 2), "read after publish");
+    }
+    holder.synchronize();
+    check((holder.retired() == 0) && (Counted::alive == 1), "reclaim");
+
+    // More readers at once than slots in a block.
+    std::vector<int> seen(16);
+    {
+        std::latch ready{ static_cast<std::ptrdiff_t>(seen.size()) };
+        std::vector<std::jthread> threads;
+        for (size_t i = 0; i < seen.size(); ++i) {
+            threads.emplace_back([&, i]() {
+                auto reader = holder.read();
+                ready.arrive_and_wait();
+                seen[i] = reader->value;
+            });
+        }
+    }
+    check(std::all_of(seen.begin(), seen.end(), [](int v) { return v == 1; }), "concurrent readers");
+
+    // Readers racing publish never go back to an older snapshot.
+    std::atomic<bool> stop{ false };
+    std::vector<int> ordered(4, 1);
+    {
+        std::vector<std::jthread> threads;
+        for (size_t i = 0; i < ordered.size(); ++i) {
+            threads.emplace_back([&, i]() {
+                for (int last = 0; !stop;) {
+                    auto reader = holder.read();
+                    ordered[i] &= (reader->value >= last) && (reader.version() == uint64_t(reader->value) + 1);
+                    last = reader->value;
+                }
+            });
+        }
+        for (int v = 2; v < 2000; ++v) {
+            holder.publish(std::make_unique<Counted>(v));
+        }
+        stop = true;
+    }
+    holder.synchronize();
+    check(std::all_of(ordered.begin(), ordered.end(), [](int o) { return o; }), "read while publishing");
+    check(Counted::alive == 1, "reclaim after publishing");
+}
+
+void testResultCache()
+{
+    using Indexer = kindex::Indexer<std::string, Assignment>;
+
+    auto docs = randomDocuments();
+    SnapshotHolder<Indexer> holder{ std::make_unique<Indexer>(Indexer::create(docs)) };
+    // Two shards of two entries each.
+    ResultCache<std::string, Assignment> cache{ 4, 2 };
+    check((cache.capacity() == 4) && (cache.shards() == 2), "ResultCache shards");
+
+    auto s = randomAssignment();
+    auto expected = bruteForce(docs, s, {});
+    ResultSet first;
+    cache.retrieve(holder.read(), first, s);
+    ResultSet second;
+    cache.retrieve(holder.read(), second, s);
+    auto metrics = cache.metrics();
+    check((metrics.misses == 1) && (metrics.hits == 1) && (cache.size() == 1), "ResultCache miss then hit");
+    check((documents(first) == expected) && (documents(second) == expected), "ResultCache retrieve");
+
+    // The order of the values does not change the entry.
+    Assignment reordered = s;
+    for (auto& [key, values] : reordered.ints) {
+        std::reverse(values.begin(), values.end());
+    }
+    for (auto& [key, values] : reordered.strings) {
+        std::reverse(values.begin(), values.end());
+    }
+    ResultSet third;
+    cache.retrieve(holder.read(), third, reordered);
+    check((cache.metrics().hits == 2) && (documents(third) == expected), "ResultCache reordered assignment");
+
+    // Every miss stores an entry, and each shard evicts beyond its two.
+    for (int64_t v = 0; v < 20; ++v) {
+        Assignment distinct;
+        distinct.ints["cached"] = { v };
+        ResultSet result;
+        cache.retrieve(holder.read(), result, distinct);
+    }
+    metrics = cache.metrics();
+    check((cache.size() <= 4) && (metrics.evictions + cache.size() == metrics.misses), "ResultCache eviction");
+
+    // A newer version drops the entries; a reader still pinned to the older one bypasses the cache.
+    auto old = holder.read();
+    auto newer = randomDocuments();
+    holder.publish(std::make_unique<Indexer>(Indexer::create(newer)));
+    ResultSet fresh;
+    cache.retrieve(holder.read(), fresh, s);
+    metrics = cache.metrics();
+    check((metrics.invalidations >= 1) && (documents(fresh) == bruteForce(newer, s, {})), "ResultCache invalidation");
+    ResultSet stale;
+    cache.retrieve(old, stale, s);
+    check((cache.metrics().misses == metrics.misses + 1) && (documents(stale) == expected),
+          "ResultCache older version");
+    ResultSet again;
+    cache.retrieve(holder.read(), again, s);
+    check((cache.metrics().hits == metrics.hits + 1) && (documents(again) == documents(fresh)),
+          "ResultCache older version not stored");
+
+    // Concurrent lookups over a small set of assignments, so threads share entries and shards.
+    ResultCache<std::string, Assignment> shared{ 8, 4 };
+    std::vector<Assignment> assignments;
+    std::vector<std::set<uint64_t>> results;
+    for (int i = 0; i < 12; ++i) {
+        assignments.push_back(randomAssignment());
+        results.push_back(bruteForce(newer, assignments.back(), {}));
+    }
+    std::vector<int> correct(4, 1);
+    {
+        std::vector<std::jthread> threads;
+        for (size_t t = 0; t < correct.size(); ++t) {
+            threads.emplace_back([&, t]() {
+                for (size_t q = 0; q < 200; ++q) {
+                    size_t i = (q * 7 + t) % assignments.size();
+                    ResultSet result;
+                    shared.retrieve(holder.read(), result, assignments[i]);
+                    correct[t] &= documents(result) == results[i];
+                }
+            });
+        }
+    }
+    check(std::all_of(correct.begin(), correct.end(), [](int c) { return c; }), "ResultCache concurrent retrieve");
+    metrics = shared.metrics();
+    check((metrics.hits + metrics.misses == 800) && (shared.size() <= 8), "ResultCache concurrent metrics");
+}
+
+// 100 documents on key a with 20 per value, 10 on b and c together, and 5 on d alone with a negative expression.
+void testIndexStats()
+{
+    using Indexer = kindex::Indexer<std::string, Assignment>;
+
+    auto expression = [](const std::string& key, decltype(Expression<std::string>::values) values, bool positive) {
+        Expression<std::string> expr;
+        expr.key = key;
+        expr.values = values;
+        expr.positive = positive;
+        return expr;
+    };
+    std::vector<Document<std::string>> docs(115);
+    for (size_t i = 0; i < docs.size(); ++i) {
+        auto& c = docs[i].conjunctions.emplace_back();
+        if (i < 100) {
+            c.expressions.push_back(expression("a", std::vector<int64_t>{ static_cast<int64_t>(i % 5) }, true));
+        } else if (i < 110) {
+            c.expressions.push_back(expression("b", std::vector<int64_t>{ 1 }, true));
+            c.expressions.push_back(expression("c", std::vector<std::string>{ "x" }, true));
+        } else {
+            c.expressions.push_back(expression("d", std::vector<int64_t>{ 1 }, false));
+        }
+    }
+    BuildOptions options;
+    options.deduplicate = false;
+    auto indexer = Indexer::create(docs, options);
+    auto stats = indexer.stats();
+    check(stats.partitions.size() == 3, "stats partitions");
+    if (stats.partitions.size() == 3) {
+        auto& zero = stats.partitions[0];
+        auto& one = stats.partitions[1];
+        auto& two = stats.partitions[2];
+        check((zero.keys == 1) && (zero.lists == 1) && (zero.entries == 5) && (stats.zEntries == 5), "stats z");
+        check((one.keys == 1) && (one.lists == 5) && (one.entries == 100), "stats size 1");
+        check((one.lengths.size() == 5) && (one.lengths[4] == 5), "stats list lengths");
+        check((two.keys == 2) && (two.lists == 2) && (two.entries == 20), "stats size 2");
+    }
+    check(stats.entryBytes >= 130 * sizeof(uint64_t), "stats entry bytes");
+    check(stats.documentBytes >= (116 + 115) * sizeof(uint64_t), "stats document bytes");
+    check((stats.partitionBytes > 0) && (stats.dictionaryBytes > 0), "stats map bytes");
+
+    // Shards split the lists but not their entries; compaction drops the entries of removed documents.
+    options.shards = 3;
+    auto sharded = Indexer::create(docs, options);
+    sharded.setCompactionThreshold(10.0);
+    for (uint64_t docId = 100; docId < 110; ++docId) {
+        sharded.remove(docId);
+    }
+    sharded.compact();
+    stats = sharded.stats();
+    uint64_t entries = 0;
+    for (auto& partition : stats.partitions) {
+        entries += partition.entries;
+    }
+    check((entries == 105) && (stats.zEntries == 5), "stats after compact");
+}
+
+bool zero(const RetrieveStats& stats)
+{
+    return (stats.partitions == 0) && (stats.groups == 0) && (stats.skipTos == 0) && (stats.skipped == 0) &&
+           (stats.sorts == 0) && (stats.matches == 0) && (stats.rejections == 0);
+}
+
+void testStats()
+{
+    using Indexer = kindex::Indexer<std::string, Assignment>;
+
+    // Without deduplication every document has its own conjunctions, so each one found takes at least one match.
+    auto docs = randomDocuments();
+    BuildOptions options;
+    options.deduplicate = false;
+    options.shards = 2;
+    auto indexer = Indexer::create(docs, options);
+    SnapshotHolder<Indexer> holder{ std::make_unique<Indexer>(Indexer::create(docs, options)) };
+    ResultCache<std::string, Assignment> cache{ 16 };
+
+    RetrieveStats total;
+    for (int q = 0; q < 20; ++q) {
+        auto s = randomAssignment();
+        RetrieveStats before = threadRetrieveStats();
+        ResultSet result;
+        indexer.retrieve(result, s);
+        RetrieveStats delta = threadRetrieveStats();
+        delta -= before;
+        total += result.stats_;
+
+        ThreadExecutor executor;
+        ResultSet parallel;
+        indexer.retrieve(parallel, s, executor, 1 + random(4));
+
+        ResultSet missed;
+        cache.retrieve(holder.read(), missed, s);
+        ResultSet hit;
+        cache.retrieve(holder.read(), hit, s);
+
+        auto& stats = result.stats_;
+        if (!KINDEX_ENABLE_STATS) {
+            check(zero(stats) && zero(delta) && zero(parallel.stats_) && zero(missed.stats_), "stats disabled");
+            continue;
+        }
+        check(stats.matches >= result.result_.size(), "stats matches");
+        check(result.result_.empty() || ((stats.partitions > 0) && (stats.groups > 0)), "stats partitions");
+        check((delta.matches == stats.matches) && (delta.skipTos == stats.skipTos) && (delta.sorts == stats.sorts),
+              "stats of the thread");
+        // Ranges split the entries of a partition, not its groups or conjunctions.
+        check((parallel.stats_.partitions == stats.partitions) && (parallel.stats_.groups == stats.groups) &&
+                (parallel.stats_.matches == stats.matches) && (parallel.stats_.rejections == stats.rejections),
+              "stats with executor");
+        check((missed.stats_.matches == stats.matches) && (missed.stats_.skipTos == stats.skipTos) && zero(hit.stats_),
+              "stats through ResultCache");
+    }
+    check(!KINDEX_ENABLE_STATS || ((total.skipTos > 0) && (total.matches > 0)), "stats counted");
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    int iterations = (argc > 1) ? std::atoi(argv[1]) : 30;
+
+    testSort<uint32_t>();
+    testSort<uint64_t>();
+    testScan<uint32_t>();
+    testScan<uint64_t>();
+    testMatch();
+    testIndexer<uint64_t>(iterations);
+    testIndexer<uint32_t>(iterations);
+    testEntryWidth();
+    testUnorderedKey();
+    testSnapshot();
+    testResultCache();
+    testIndexStats();
+    testStats();
+    testNuma();
+
+    if (failures != 0) {
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}